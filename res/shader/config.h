@@ -3,7 +3,17 @@
 
 // same as in gl_texmgr.c
 #define MAX_GLTEXTURES 4096
-#define MAX_GEOMETRIES 16
+// Geometry slots (TLAS custom index, vtx/prev_vtx/idx/ext descriptors): up to four for the static
+// world, the baked static entities and the dynamic geometry, the rest for instanced brush
+// submodels. Submodel entities without a slot are added to the dynamic geometry.
+#define MAX_GEOMETRIES 64
+
+// The custom index of a TLAS instance is its geometry index with INSTANCE_FLAG_* in the upper bits.
+#define INSTANCE_GEOMETRY_MASK 0xffff
+// prev_vtx holds the motion prev - cur of each vertex as 4 halfs (w unused) instead of positions.
+#define INSTANCE_FLAG_MOTION_DELTA (1 << 16)
+// Larger motion deltas (teleports) are stored as 0.
+#define MOTION_DELTA_MAX 256.0
 
 // Configure ray tracing
 
@@ -19,6 +19,19 @@
 #include "merian-shaders/textures.glsl"
 #include "merian-shaders/color/colors_yuv.glsl"
 
+// the custom index of the instance holds the geometry index and INSTANCE_FLAG_*
+#define rq_geometry(rq) (rq_instance_id(rq) & INSTANCE_GEOMETRY_MASK)
+#define rq_geometry_uc(rq) (rq_instance_id_uc(rq) & INSTANCE_GEOMETRY_MASK)
+
+// Motion prev - cur of a vertex of a geometry with INSTANCE_FLAG_MOTION_DELTA. buf_prev_vtx holds
+// 4 halfs per vertex then, see write_motion_deltas in vertex_transform.hpp.
+vec3 motion_delta(const uint geometry, const uint vertex) {
+    const uint f = 2 * vertex;
+    const uint xy = floatBitsToUint(buf_prev_vtx[nonuniformEXT(geometry)].v[f / 3][f % 3]);
+    const uint z = floatBitsToUint(buf_prev_vtx[nonuniformEXT(geometry)].v[(f + 1) / 3][(f + 1) % 3]);
+    return vec3(unpackHalf2x16(xy), unpackHalf2x16(z).x);
+}
+
 // assert(alpha != 0)
 #define decode_alpha(enc_alpha) (float16_t(enc_alpha - 1) / 14.hf)
 
@@ -93,25 +106,27 @@ void trace_ray_init(rayQueryEXT ray_query, const vec3 direction, const vec3 posi
 }
 
 void trace_ray(rayQueryEXT ray_query) {
-    VertexExtraData extra_data;
-    uint16_t flags;
-    vec2 st;
-
+    // Only load the fields needed for the alpha test, not the whole VertexExtraData.
     while(rayQueryProceedEXT(ray_query)) {
-        extra_data = buf_ext[nonuniformEXT(rq_instance_id_uc(ray_query))].v[rq_primitive_index_uc(ray_query)];
-        flags = extra_data.texnum_fb_flags >> 12;
-        const uint16_t alpha = extra_data.texnum_alpha >> 12;
+        const uint instance = rq_geometry_uc(ray_query);
+        const uint primitive = rq_primitive_index_uc(ray_query);
+        const uint16_t flags = buf_ext[nonuniformEXT(instance)].v[primitive].texnum_fb_flags >> 12;
         if (flags > 0 && flags < 7) {
             // treat sky, lava, slime,... not transparent for now
             rayQueryConfirmIntersectionEXT(ray_query);
-        } else if (alpha != 0) { // 0 means use texture
+            continue;
+        }
+
+        const uint16_t texnum_alpha = buf_ext[nonuniformEXT(instance)].v[primitive].texnum_alpha;
+        const uint16_t alpha = texnum_alpha >> 12;
+        if (alpha != 0) { // 0 means use texture
             if (decode_alpha(alpha) >= ALPHA_THRESHOLD) {
                 rayQueryConfirmIntersectionEXT(ray_query);
             }
         } else {
             // We covered the flags above, this surface cannot warp
-            st = extra_data.st * rq_barycentrics_uc(ray_query);
-            if (textureGather(img_tex[nonuniformEXT(min(extra_data.texnum_alpha & 0xfff, MAX_GLTEXTURES - 1))], st, 3).r >= ALPHA_THRESHOLD) {
+            const vec2 st = buf_ext[nonuniformEXT(instance)].v[primitive].st * rq_barycentrics_uc(ray_query);
+            if (textureGather(img_tex[nonuniformEXT(min(texnum_alpha & 0xfff, MAX_GLTEXTURES - 1))], st, 3).r >= ALPHA_THRESHOLD) {
                 rayQueryConfirmIntersectionEXT(ray_query);
             }
         }
@@ -132,7 +147,7 @@ bool trace_visibility(accelerationStructureEXT tlas, const vec3 from, const vec3
     }
 
     // Need this for restir, because with artificially move the position in trace ray when we hit the skybox...
-    const uint16_t flags = buf_ext[nonuniformEXT(rq_instance_id(ray_query))].v[rq_primitive_index(ray_query)].texnum_fb_flags >> 12;
+    const uint16_t flags = buf_ext[nonuniformEXT(rq_geometry(ray_query))].v[rq_primitive_index(ray_query)].texnum_fb_flags >> 12;
     if (flags == MAT_FLAGS_SKY) {
         return true;
     }
@@ -179,7 +194,7 @@ void trace_ray(inout f16vec3 throughput, inout f16vec3 contribution, inout Hit h
     }
 
     // HIT
-    const VertexExtraData extra_data = buf_ext[nonuniformEXT(rq_instance_id(ray_query))].v[rq_primitive_index(ray_query)];
+    const VertexExtraData extra_data = buf_ext[nonuniformEXT(rq_geometry(ray_query))].v[rq_primitive_index(ray_query)];
     const uint16_t flags = extra_data.texnum_fb_flags >> 12;
 
     if (flags == MAT_FLAGS_SKY) {
@@ -208,24 +223,36 @@ void trace_ray(inout f16vec3 throughput, inout f16vec3 contribution, inout Hit h
     const f16mat2 st_dudv = f16mat2(extra_data.st[2] - extra_data.st[0],
                                     extra_data.st[1] - extra_data.st[0]);
     {
-        const uvec3 prim_indexes = buf_idx[nonuniformEXT(rq_instance_id(ray_query))].i[rq_primitive_index(ray_query)];
+        const uvec3 prim_indexes = buf_idx[nonuniformEXT(rq_geometry(ray_query))].i[rq_primitive_index(ray_query)];
         vec3 verts[3];
 #ifdef MERIAN_CONTEXT_EXT_ENABLED_ExtensionVkRayTracingPositionFetch
         rayQueryGetIntersectionTriangleVertexPositionsEXT(ray_query, true, verts);
 #else
-        verts[0] = buf_vtx[nonuniformEXT(rq_instance_id(ray_query))].v[prim_indexes.x];
-        verts[1] = buf_vtx[nonuniformEXT(rq_instance_id(ray_query))].v[prim_indexes.y];
-        verts[2] = buf_vtx[nonuniformEXT(rq_instance_id(ray_query))].v[prim_indexes.z];
+        verts[0] = buf_vtx[nonuniformEXT(rq_geometry(ray_query))].v[prim_indexes.x];
+        verts[1] = buf_vtx[nonuniformEXT(rq_geometry(ray_query))].v[prim_indexes.y];
+        verts[2] = buf_vtx[nonuniformEXT(rq_geometry(ray_query))].v[prim_indexes.z];
 #endif
+        // brush submodels are stored in model space, prev_vtx is in the current model space.
+        const mat4x3 object_to_world = rayQueryGetIntersectionObjectToWorldEXT(ray_query, true);
+        verts[0] = object_to_world * vec4(verts[0], 1);
+        verts[1] = object_to_world * vec4(verts[1], 1);
+        verts[2] = object_to_world * vec4(verts[2], 1);
+
         hit.pos = verts[0] * bary.x  + verts[1] * bary.y + verts[2] * bary.z;
         dudv[0] = verts[2] - verts[0];
         dudv[1] = verts[1] - verts[0];
         hit.normal = normalize(cross(dudv[0], dudv[1]));
         hit.enc_geonormal = geo_encode_normal(hit.normal);
 
-        hit.prev_pos = buf_prev_vtx[nonuniformEXT(rq_instance_id(ray_query))].v[prim_indexes.x] * bary.x
-                     + buf_prev_vtx[nonuniformEXT(rq_instance_id(ray_query))].v[prim_indexes.y] * bary.y
-                     + buf_prev_vtx[nonuniformEXT(rq_instance_id(ray_query))].v[prim_indexes.z] * bary.z;
+        if ((rq_instance_id(ray_query) & INSTANCE_FLAG_MOTION_DELTA) != 0) {
+            hit.prev_pos = hit.pos + mat3(object_to_world) * (motion_delta(rq_geometry(ray_query), prim_indexes.x) * bary.x
+                                                            + motion_delta(rq_geometry(ray_query), prim_indexes.y) * bary.y
+                                                            + motion_delta(rq_geometry(ray_query), prim_indexes.z) * bary.z);
+        } else {
+            hit.prev_pos = object_to_world * vec4(buf_prev_vtx[nonuniformEXT(rq_geometry(ray_query))].v[prim_indexes.x] * bary.x
+                                                + buf_prev_vtx[nonuniformEXT(rq_geometry(ray_query))].v[prim_indexes.y] * bary.y
+                                                + buf_prev_vtx[nonuniformEXT(rq_geometry(ray_query))].v[prim_indexes.z] * bary.z, 1);
+        }
     }
 
 
@@ -5,14 +5,15 @@
 
 // See quake_node.hpp
 struct VertexExtraData {
+    // hot: read for every candidate hit
     uint16_t texnum_alpha;
     uint16_t texnum_fb_flags;
+    f16mat3x2 st;
 
+    // cold: read for the closest hit only
     uint n0_gloss_norm;
     uint n1_brush;
     uint n2;
-
-    f16mat3x2 st;
 };
 
 struct UniformData {
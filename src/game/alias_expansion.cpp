@@ -0,0 +1,257 @@
+#include "alias_expansion.hpp"
+
+#include "merian/utils/bitpacking.hpp"
+#include "merian/utils/normal_encoding.hpp"
+
+#include <bit>
+#include <cstring>
+#include <spdlog/spdlog.h>
+
+// see anorms.h in Quake
+static constexpr uint32_t NUM_VERTEX_NORMALS = 162;
+
+void AliasPoseData::build() {
+    models.clear();
+    data.clear();
+
+    for (uint32_t i = 0; i < NUM_VERTEX_NORMALS; i++)
+        for (int k = 0; k < 3; k++)
+            data.emplace_back(std::bit_cast<uint32_t>(r_avertexnormals[i][k]));
+
+    std::lock_guard<std::mutex> lock(alias_hdr_mutex);
+    for (int i = 1; i < MAX_MODELS; i++) {
+        qmodel_t* m = cl.model_precache[i];
+        if (!m)
+            continue;
+        if (m->type != mod_alias)
+            continue;
+
+        aliashdr_t* hdr = (aliashdr_t*)Mod_Extradata(m);
+        const aliasmesh_t* desc = (aliasmesh_t*)((uint8_t*)hdr + hdr->meshdesc);
+        const int16_t* indexes = (int16_t*)((uint8_t*)hdr + hdr->indexes);
+        const trivertx_t* trivertexes = (trivertx_t*)((uint8_t*)hdr + hdr->vertexes);
+
+        AliasModelData model_data{};
+        model_data.numposes = hdr->numposes;
+        model_data.numverts = hdr->numverts;
+        model_data.numverts_vbo = hdr->numverts_vbo;
+        model_data.numindexes = hdr->numindexes;
+
+        model_data.pose_offset = data.size();
+        for (int v = 0; v < hdr->numposes * hdr->numverts; v++) {
+            data.emplace_back((uint32_t)trivertexes[v].v[0] | (uint32_t)trivertexes[v].v[1] << 8 |
+                              (uint32_t)trivertexes[v].v[2] << 16 |
+                              (uint32_t)trivertexes[v].lightnormalindex << 24);
+        }
+
+        model_data.desc_offset = data.size();
+        for (int v = 0; v < hdr->numverts_vbo; v++) {
+            const uint32_t s = merian::float_to_half((desc[v].st[0] + 0.5) / (float)hdr->skinwidth);
+            const uint32_t t =
+                merian::float_to_half((desc[v].st[1] + 0.5) / (float)hdr->skinheight);
+            data.emplace_back(desc[v].vertindex);
+            data.emplace_back(s | t << 16);
+        }
+
+        model_data.index_offset = data.size();
+        for (int v = 0; v < hdr->numindexes; v++) {
+            data.emplace_back(indexes[v]);
+        }
+
+        models[m] = model_data;
+    }
+
+    SPDLOG_DEBUG("alias pose data: {} models, {} MiB", models.size(),
+                 data.size() * sizeof(uint32_t) / 1024. / 1024.);
+}
+
+const AliasModelData* AliasPoseData::find(const qmodel_t* model) const {
+    const auto it = models.find(model);
+    if (it == models.end())
+        return nullptr;
+    return &it->second;
+}
+
+bool make_alias_instance(entity_t* ent,
+                         aliashdr_t* hdr,
+                         const AliasModelData& model_data,
+                         AliasInstance& instance,
+                         const bool update_state) {
+    if (ent->frame < 0 || ent->frame >= hdr->numposes)
+        return false;
+
+    lerpdata_t lerpdata;
+    glm::mat4 mat_model;
+    glm::mat4 mat_prev_model;
+    setup_alias_transforms(ent, hdr, lerpdata, mat_model, mat_prev_model);
+
+    instance.model = glm::mat4x3(mat_model);
+    instance.prev_model = glm::mat4x3(mat_prev_model);
+    instance.pose1 = lerpdata.pose1;
+    instance.pose2 = lerpdata.pose2;
+    instance.blend = lerpdata.blend;
+    instance.prev_blend = ent->mv_prev_blend;
+
+    instance.pose_offset = model_data.pose_offset;
+    instance.desc_offset = model_data.desc_offset;
+    instance.index_offset = model_data.index_offset;
+    instance.numverts = model_data.numverts;
+    instance.numverts_vbo = model_data.numverts_vbo;
+    instance.numindexes = model_data.numindexes;
+
+    const int sk = glm::clamp(ent->skinnum, 0, hdr->numskins - 1),
+              fm = ((int)(cl.time * 10)) & 3;
+    const uint32_t texnum_alpha = make_texnum_alpha(hdr->gltextures[sk][fm]);
+    const uint32_t fb_texnum = hdr->fbtextures[sk][fm] ? hdr->fbtextures[sk][fm]->texnum : 0;
+    instance.texnums = texnum_alpha | fb_texnum << 16;
+    if (hdr->nmtextures[sk][fm]) {
+        instance.gloss_norm =
+            merian::pack_uint32(hdr->gstextures[sk][fm] ? hdr->gstextures[sk][fm]->texnum : 0,
+                                hdr->nmtextures[sk][fm]->texnum);
+        instance.normalmap = 1;
+    } else {
+        instance.gloss_norm = 0;
+        instance.normalmap = 0;
+    }
+
+    if (update_state) {
+        ent->mv_prev_blend = lerpdata.blend;
+        VectorCopy(lerpdata.angles, ent->mv_prev_angles);
+        VectorCopy(lerpdata.origin, ent->mv_prev_origin);
+    }
+
+    return true;
+}
+
+void expand_alias_instance(const AliasInstance& instance,
+                           const std::vector<uint32_t>& pose_data,
+                           float* vtx,
+                           float* prev_vtx,
+                           uint32_t* idx,
+                           VertexExtraData* ext) {
+    const glm::mat4 mat_model = glm::mat4(instance.model);
+    const glm::mat4 mat_prev_model = glm::mat4(instance.prev_model);
+    const glm::mat3 mat_model_inv_t = glm::transpose(glm::inverse(mat_model));
+
+    const auto trivertex = [&](const uint32_t pose, const uint32_t local_vertex) {
+        const uint32_t vertindex = pose_data[instance.desc_offset + 2 * local_vertex];
+        return pose_data[instance.pose_offset + instance.numverts * pose + vertindex];
+    };
+    const auto position = [](const uint32_t packed) {
+        return glm::vec3(packed & 0xff, (packed >> 8) & 0xff, (packed >> 16) & 0xff);
+    };
+    const auto normal = [&](const uint32_t packed) {
+        const uint32_t i = 3 * (packed >> 24);
+        return glm::vec3(std::bit_cast<float>(pose_data[i]), std::bit_cast<float>(pose_data[i + 1]),
+                         std::bit_cast<float>(pose_data[i + 2]));
+    };
+
+    for (uint32_t v = 0; v < instance.numverts_vbo; v++) {
+        const glm::vec3 pos_pose1 = position(trivertex(instance.pose1, v));
+        const glm::vec3 pos_pose2 = position(trivertex(instance.pose2, v));
+
+        const glm::vec3 world_pos =
+            mat_model * glm::vec4(glm::mix(pos_pose1, pos_pose2, instance.blend), 1.0);
+        const glm::vec3 old_world_pos =
+            mat_prev_model * glm::vec4(glm::mix(pos_pose1, pos_pose2, instance.prev_blend), 1.0);
+
+        const uint32_t out = 3 * (instance.vertex_offset + v);
+        for (int k = 0; k < 3; k++) {
+            vtx[out + k] = world_pos[k];
+            prev_vtx[out + k] = old_world_pos[k];
+        }
+    }
+
+    for (uint32_t i = 0; i < instance.numindexes / 3; i++) {
+        const uint32_t prim = instance.primitive_offset + i;
+        uint32_t n[3];
+        uint32_t st[3];
+        for (int k = 0; k < 3; k++) {
+            const uint32_t local_vertex = pose_data[instance.index_offset + 3 * i + k];
+            idx[3 * prim + k] = instance.vertex_offset + local_vertex;
+            st[k] = pose_data[instance.desc_offset + 2 * local_vertex + 1];
+
+            const glm::vec3 world_n = glm::normalize(
+                mat_model_inv_t * glm::mix(normal(trivertex(instance.pose1, local_vertex)),
+                                           normal(trivertex(instance.pose2, local_vertex)),
+                                           instance.blend));
+            n[k] = merian::encode_normal(world_n);
+        }
+
+        VertexExtraData& extra = ext[prim];
+        extra.texnum_alpha = instance.texnums & 0xffff;
+        extra.texnum_fb_flags = instance.texnums >> 16;
+        if (instance.normalmap) {
+            // this discards the vertex normals
+            extra.n0_gloss_norm = instance.gloss_norm;
+            extra.n1_brush = 0xffffffff; // mark as brush model -> to use normal map
+            extra.n2 = 0;
+        } else {
+            extra.n0_gloss_norm = n[0];
+            extra.n1_brush = n[1];
+            extra.n2 = n[2];
+        }
+        extra.s_0 = st[0] & 0xffff;
+        extra.t_0 = st[0] >> 16;
+        extra.s_1 = st[1] & 0xffff;
+        extra.t_1 = st[1] >> 16;
+        extra.s_2 = st[2] & 0xffff;
+        extra.t_2 = st[2] >> 16;
+    }
+}
+
+uint32_t verify_alias_expansion(const entity_t* ent,
+                                const AliasModelData& model_data,
+                                const std::vector<uint32_t>& pose_data) {
+    // Both paths advance the lerp and motion vector state, run them on copies that start from the
+    // same state to keep the rendered entity untouched.
+    entity_t ref_ent = *ent;
+    entity_t cpu_ent = *ent;
+
+    AliasInstance instance;
+    {
+        std::lock_guard<std::mutex> lock(alias_hdr_mutex);
+        aliashdr_t* hdr = (aliashdr_t*)Mod_Extradata(ref_ent.model);
+        if (!make_alias_instance(&ref_ent, hdr, model_data, instance))
+            return 0;
+    }
+    instance.vertex_offset = 0;
+    instance.primitive_offset = 0;
+
+    std::vector<float> ref_vtx(3 * instance.numverts_vbo);
+    std::vector<float> ref_prev_vtx(3 * instance.numverts_vbo);
+    std::vector<uint32_t> ref_idx(instance.numindexes);
+    std::vector<VertexExtraData> ref_ext(instance.numindexes / 3);
+    expand_alias_instance(instance, pose_data, ref_vtx.data(), ref_prev_vtx.data(), ref_idx.data(),
+                          ref_ext.data());
+
+    std::vector<float> vtx;
+    std::vector<float> prev_vtx;
+    std::vector<uint32_t> idx;
+    std::vector<VertexExtraData> ext;
+    add_geo_alias(&cpu_ent, cpu_ent.model, vtx, prev_vtx, idx, ext);
+
+    if (vtx.size() != ref_vtx.size() || prev_vtx.size() != ref_prev_vtx.size() ||
+        idx.size() != ref_idx.size() || ext.size() != ref_ext.size()) {
+        return std::max<uint32_t>(1, ref_vtx.size() + ref_idx.size() + ref_ext.size());
+    }
+
+    // allow for differences in fused multiply-add
+    const auto differs = [](const float a, const float b) {
+        return std::abs(a - b) > 1e-4f * std::max(1.f, std::abs(a));
+    };
+
+    uint32_t mismatches = 0;
+    for (std::size_t i = 0; i < vtx.size(); i++) {
+        mismatches += differs(vtx[i], ref_vtx[i]);
+        mismatches += differs(prev_vtx[i], ref_prev_vtx[i]);
+    }
+    for (std::size_t i = 0; i < idx.size(); i++) {
+        mismatches += idx[i] != ref_idx[i];
+    }
+    for (std::size_t i = 0; i < ext.size(); i++) {
+        mismatches += std::memcmp(&ext[i], &ref_ext[i], sizeof(VertexExtraData)) != 0;
+    }
+
+    return mismatches;
+}
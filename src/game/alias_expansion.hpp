@@ -0,0 +1,107 @@
+#pragma once
+
+#include "game/quake_helpers.hpp"
+
+#include <glm/glm.hpp>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include "quakedef.h"
+}
+
+// GPU expansion of alias models.
+//
+// The poses of all alias models are uploaded once when a world is spawned. Per frame only an
+// AliasInstance is recorded for each alias entity which is then expanded into vtx, prev_vtx, idx
+// and ext by shader/game/alias_expand.comp. expand_alias_instance is the CPU reference of that
+// shader and produces the same output as add_geo_alias.
+
+// Location of a model in the pose data (in uint32 words).
+struct AliasModelData {
+    // numposes * numverts packed trivertx_t (x, y, z, lightnormalindex)
+    uint32_t pose_offset;
+    // numverts_vbo * (vertindex, half2 texture coordinates)
+    uint32_t desc_offset;
+    // numindexes vertex indices
+    uint32_t index_offset;
+
+    uint32_t numposes;
+    uint32_t numverts;
+    uint32_t numverts_vbo;
+    uint32_t numindexes;
+};
+
+// Must match AliasInstance in alias_expand.comp (scalar layout).
+struct AliasInstance {
+    glm::mat4x3 model;
+    glm::mat4x3 prev_model;
+
+    uint32_t pose1;
+    uint32_t pose2;
+    float blend;
+    float prev_blend;
+
+    // see AliasModelData
+    uint32_t pose_offset;
+    uint32_t desc_offset;
+    uint32_t index_offset;
+    uint32_t numverts;
+    uint32_t numverts_vbo;
+    uint32_t numindexes;
+
+    // where the expanded geometry is written in the dynamic buffers
+    uint32_t vertex_offset;
+    uint32_t primitive_offset;
+
+    // texnum_alpha | fullbright texnum << 16, the first word of VertexExtraData
+    uint32_t texnums;
+    // glossmap and normalmap texnum, only valid if normalmap != 0
+    uint32_t gloss_norm;
+    uint32_t normalmap;
+};
+
+class AliasPoseData {
+  public:
+    // (Re-)builds the pose data for all alias models in cl.model_precache.
+    void build();
+
+    // Returns nullptr if the model was not known at build time.
+    const AliasModelData* find(const qmodel_t* model) const;
+
+    // The normal table (NUMVERTEXNORMALS vec3) followed by the data of all models.
+    const std::vector<uint32_t>& get_data() const {
+        return data;
+    }
+
+    std::size_t model_count() const {
+        return models.size();
+    }
+
+  private:
+    std::unordered_map<const qmodel_t*, AliasModelData> models;
+    std::vector<uint32_t> data;
+};
+
+// Records the instance for ent, the output offsets are not set. Returns false if nothing should be
+// drawn. If update_state is true the motion vector state of the entity is advanced like in
+// add_geo_alias. hdr must be the resolved header of ent->model (see ResolvedAliasModel).
+bool make_alias_instance(entity_t* ent,
+                         aliashdr_t* hdr,
+                         const AliasModelData& model_data,
+                         AliasInstance& instance,
+                         const bool update_state = true);
+
+// CPU reference for alias_expand.comp. Writes to the offsets stored in the instance.
+void expand_alias_instance(const AliasInstance& instance,
+                           const std::vector<uint32_t>& pose_data,
+                           float* vtx,
+                           float* prev_vtx,
+                           uint32_t* idx,
+                           VertexExtraData* ext);
+
+// Expands a copy of ent using the CPU reference and another copy using add_geo_alias and returns
+// the number of differing values. ent is not modified. Must not run concurrently to Host_Frame.
+uint32_t verify_alias_expansion(const entity_t* ent,
+                                const AliasModelData& model_data,
+                                const std::vector<uint32_t>& pose_data);
@@ -0,0 +1,69 @@
+#include "alias_pose_cache.hpp"
+
+#include "merian/utils/bitpacking.hpp"
+
+#include <memory>
+#include <unordered_map>
+
+// unique_ptr to keep references stable while the map grows
+static std::unordered_map<const qmodel_t*, std::unique_ptr<AliasPoseCache>> alias_pose_caches;
+
+static std::unique_ptr<AliasPoseCache> build_alias_pose_cache(const aliashdr_t* hdr) {
+    const aliasmesh_t* desc = (aliasmesh_t*)((uint8_t*)hdr + hdr->meshdesc);
+    const int16_t* indexes = (int16_t*)((uint8_t*)hdr + hdr->indexes);
+    const trivertx_t* trivertexes = (trivertx_t*)((uint8_t*)hdr + hdr->vertexes);
+
+    std::unique_ptr<AliasPoseCache> cache = std::make_unique<AliasPoseCache>();
+    cache->numposes = hdr->numposes;
+    cache->numverts_vbo = hdr->numverts_vbo;
+    cache->numindexes = hdr->numindexes;
+
+    const std::size_t size = (std::size_t)hdr->numposes * hdr->numverts_vbo;
+    cache->x.resize(size);
+    cache->y.resize(size);
+    cache->z.resize(size);
+    cache->nx.resize(size);
+    cache->ny.resize(size);
+    cache->nz.resize(size);
+
+    for (int pose = 0; pose < hdr->numposes; pose++) {
+        for (int v = 0; v < hdr->numverts_vbo; v++) {
+            const trivertx_t& trivertex = trivertexes[hdr->numverts * pose + desc[v].vertindex];
+            const float* n = r_avertexnormals[trivertex.lightnormalindex];
+            const std::size_t i = (std::size_t)hdr->numverts_vbo * pose + v;
+
+            cache->x[i] = trivertex.v[0];
+            cache->y[i] = trivertex.v[1];
+            cache->z[i] = trivertex.v[2];
+            cache->nx[i] = n[0];
+            cache->ny[i] = n[1];
+            cache->nz[i] = n[2];
+        }
+    }
+
+    cache->s.resize(hdr->numverts_vbo);
+    cache->t.resize(hdr->numverts_vbo);
+    for (int v = 0; v < hdr->numverts_vbo; v++) {
+        cache->s[v] = merian::float_to_half((desc[v].st[0] + 0.5) / (float)hdr->skinwidth);
+        cache->t[v] = merian::float_to_half((desc[v].st[1] + 0.5) / (float)hdr->skinheight);
+    }
+
+    cache->indexes.resize(hdr->numindexes);
+    for (int i = 0; i < hdr->numindexes; i++) {
+        cache->indexes[i] = indexes[i];
+    }
+
+    return cache;
+}
+
+const AliasPoseCache& get_alias_pose_cache(const qmodel_t* m, const aliashdr_t* hdr) {
+    std::unique_ptr<AliasPoseCache>& cache = alias_pose_caches[m];
+    if (!cache) {
+        cache = build_alias_pose_cache(hdr);
+    }
+    return *cache;
+}
+
+void clear_alias_pose_caches() {
+    alias_pose_caches.clear();
+}
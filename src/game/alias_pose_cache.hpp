@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include "quakedef.h"
+}
+
+// Decoded poses of an alias model for the CPU extraction path.
+//
+// Positions and normals are stored as structure of arrays for every pose and are already resolved
+// to the vbo vertices (desc[v].vertindex), such that a pose p starts at numverts_vbo * p.
+struct AliasPoseCache {
+    uint32_t numposes;
+    uint32_t numverts_vbo;
+    uint32_t numindexes;
+
+    // model space positions (before scale and scale_origin)
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    // model space normals from r_avertexnormals
+    std::vector<float> nx;
+    std::vector<float> ny;
+    std::vector<float> nz;
+
+    // texture coordinates per vbo vertex, encoded using float_to_half
+    std::vector<uint16_t> s;
+    std::vector<uint16_t> t;
+
+    // vbo vertex indices
+    std::vector<uint32_t> indexes;
+};
+
+// Returns the cache for the alias model m, it is built when the model is first seen.
+// hdr must be the header of m. Not thread safe, call with alias_hdr_mutex held.
+const AliasPoseCache& get_alias_pose_cache(const qmodel_t* m, const aliashdr_t* hdr);
+
+// Must be called when models are (re-)loaded, e.g. on worldspawn.
+void clear_alias_pose_caches();
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Channel for input events and console commands from the UI thread into the game thread.
+//
+// The input callbacks and properties run on the render thread while Host_Frame runs on the game
+// thread. Events are timestamped when they are pushed and applied by the game thread at the start
+// of a tick, which also measures the latency until the simulation sees them.
+
+using InputClock = std::chrono::steady_clock;
+
+struct InputEvent {
+    enum Type {
+        KEY,
+        // mouse_x, mouse_y are updated. If reset is set mouse_old{x,y} are reset as well.
+        MOUSE_CURSOR,
+        COMMAND,
+    };
+
+    Type type = KEY;
+    int key = 0;
+    bool down = false;
+    double x = 0;
+    double y = 0;
+    bool reset = false;
+    std::string command;
+    InputClock::time_point timestamp;
+};
+
+// Lock-free ring buffer for one producer and one consumer thread.
+template <typename T, std::size_t CAPACITY> class SPSCRing {
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "capacity must be a power of two");
+
+  public:
+    // Producer only. Returns false if the ring is full.
+    bool push(T&& value) {
+        const std::size_t head = write_index.load(std::memory_order_relaxed);
+        if (head - read_index.load(std::memory_order_acquire) == CAPACITY)
+            return false;
+        slots[head & (CAPACITY - 1)] = std::move(value);
+        write_index.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns the oldest element without removing it, nullptr if empty.
+    T* front() {
+        const std::size_t tail = read_index.load(std::memory_order_relaxed);
+        if (tail == write_index.load(std::memory_order_acquire))
+            return nullptr;
+        return &slots[tail & (CAPACITY - 1)];
+    }
+
+    // Consumer only. Removes the element returned by front.
+    void pop() {
+        read_index.store(read_index.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_release);
+    }
+
+  private:
+    std::array<T, CAPACITY> slots;
+    alignas(64) std::atomic<std::size_t> write_index = 0;
+    alignas(64) std::atomic<std::size_t> read_index = 0;
+};
+
+// Histogram with power of two buckets in microseconds: bucket i counts latencies in
+// [2^(i-1), 2^i) us, bucket 0 everything below 1 us and the last bucket everything above.
+// Written by the game thread, read by the UI.
+class LatencyHistogram {
+  public:
+    static constexpr uint32_t BUCKETS = 20;
+
+    void record(const InputClock::duration latency) {
+        const uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+        uint32_t bucket = 0;
+        while (bucket + 1 < BUCKETS && (1ull << bucket) <= us)
+            bucket++;
+        counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        total_us.fetch_add(us, std::memory_order_relaxed);
+        max_us.store(std::max(max_us.load(std::memory_order_relaxed), us),
+                     std::memory_order_relaxed);
+    }
+
+    uint64_t count(const uint32_t bucket) const {
+        return counts[bucket].load(std::memory_order_relaxed);
+    }
+
+    uint64_t total_count() const {
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < BUCKETS; i++)
+            total += count(i);
+        return total;
+    }
+
+    double mean_us() const {
+        const uint64_t total = total_count();
+        return total > 0 ? (double)total_us.load(std::memory_order_relaxed) / total : 0.;
+    }
+
+    uint64_t get_max_us() const {
+        return max_us.load(std::memory_order_relaxed);
+    }
+
+    void reset() {
+        for (auto& c : counts)
+            c.store(0, std::memory_order_relaxed);
+        total_us.store(0, std::memory_order_relaxed);
+        max_us.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    std::array<std::atomic_uint64_t, BUCKETS> counts{};
+    std::atomic_uint64_t total_us = 0;
+    std::atomic_uint64_t max_us = 0;
+};
@@ -0,0 +1,229 @@
+#include "particle_expansion.hpp"
+
+#include "merian/utils/bitpacking.hpp"
+#include "merian/utils/glm.hpp"
+#include "merian/utils/normal_encoding.hpp"
+
+#include "../../res/shader/config.h"
+
+#include <algorithm>
+#include <cmath>
+#include <glm/gtc/matrix_transform.hpp>
+
+extern "C" {
+// from r_part.c
+extern particle_t* active_particles;
+}
+
+// corners of the tetrahedron
+static const glm::vec3 voff[4] = {
+    {0.0, 1.0, 0.0},
+    {-0.5, -0.5, 0.87},
+    {-0.5, -0.5, -0.87},
+    {1.0, -0.5, 0.0},
+};
+
+ParticleRecord make_particle_record(const particle_t* p,
+                                    const vec3_t r_origin,
+                                    const vec3_t vpn,
+                                    const uint32_t texnum_blood,
+                                    const uint32_t texnum_explosion,
+                                    const bool no_random,
+                                    const double prev_cl_time,
+                                    const float keep_probability) {
+    ParticleRecord record;
+    record.origin = *merian::as_vec3(p->org);
+    record.prev_origin = *merian::as_vec3(p->mv_prev_origin);
+
+    record.scale = particle_scale(p, r_origin, vpn);
+    record.color = d_8to24table[(int)p->color];
+    record.seed = particle_seed(p, no_random);
+
+    uint32_t texnum;
+    uint32_t texnum_fb;
+    classify_particle(p, record.color, texnum_blood, texnum_explosion, texnum, texnum_fb,
+                      record.scale);
+    record.texnums = texnum | texnum_fb << 16;
+    // the survivors cover the area of the dropped particles
+    record.scale /= std::sqrt(keep_probability);
+
+    // in double, cl.time is too large for float
+    const double speed = 0.001 * glm::length(*merian::as_vec3(p->vel));
+    record.rotation = std::fmod(cl.time * speed, 1.0);
+    record.prev_rotation = std::fmod(prev_cl_time * speed, 1.0);
+
+    return record;
+}
+
+void make_particle_records(std::vector<ParticleRecord>& records,
+                           const uint32_t texnum_blood,
+                           const uint32_t texnum_explosion,
+                           const bool no_random,
+                           const double prev_cl_time,
+                           const float keep_probability,
+                           const bool update_state) {
+    records.clear();
+
+    vec3_t vpn, vright, vup, r_origin;
+    VectorCopy(r_refdef.vieworg, r_origin);
+    AngleVectors(r_refdef.viewangles, vpn, vright, vup);
+
+    for (particle_t* p = active_particles; p; p = p->next) {
+        if (keep_particle(p, no_random, keep_probability)) {
+            records.emplace_back(make_particle_record(p, r_origin, vpn, texnum_blood,
+                                                      texnum_explosion, no_random, prev_cl_time,
+                                                      keep_probability));
+        }
+        if (update_state)
+            VectorCopy(p->org, p->mv_prev_origin);
+    }
+}
+
+void expand_particle_record(const ParticleRecord& record,
+                            const uint32_t vertex_offset,
+                            const uint32_t primitive_offset,
+                            float* vtx,
+                            float* prev_vtx,
+                            uint32_t* idx,
+                            VertexExtraData* ext) {
+    ParticleRandom rand(record.seed);
+
+    const float particle_offset = 2 * (rand.next() - 0.5f) + 2 * (rand.next() - 0.5f);
+    const float rand_angle = rand.next();
+    const float axis_x = rand.next();
+    const float axis_y = rand.next();
+    const float axis_z = rand.next();
+    const glm::vec3 rand_v = glm::normalize(glm::vec3(axis_x, axis_y, axis_z));
+
+    const float two_pi = 2 * M_PI;
+    const glm::mat3 rotation = glm::mat3(
+        glm::rotate(glm::identity<glm::mat4>(), (rand_angle + record.rotation) * two_pi, rand_v));
+    const glm::mat3 prev_rotation = glm::mat3(glm::rotate(
+        glm::identity<glm::mat4>(), (rand_angle + record.prev_rotation) * two_pi, rand_v));
+
+    glm::vec3 vert[4];
+    for (int k = 0; k < 4; k++) {
+        const float vertex_offset_k = 0.5f * ((rand.next() - 0.5f) + (rand.next() - 0.5f));
+        const float rand_offset_scale = rand.next();
+        const glm::vec3 local = record.scale * voff[k] * (1 + rand_offset_scale) + vertex_offset_k;
+
+        vert[k] = record.origin + particle_offset + rotation * local;
+        const glm::vec3 prev_vert = record.prev_origin + particle_offset + prev_rotation * local;
+
+        const uint32_t out = 3 * (vertex_offset + k);
+        for (int l = 0; l < 3; l++) {
+            vtx[out + l] = vert[k][l];
+            prev_vtx[out + l] = prev_vert[l];
+        }
+    }
+
+    static constexpr uint32_t faces[4][3] = {{0, 1, 2}, {0, 2, 3}, {0, 3, 1}, {1, 3, 2}};
+    const uint32_t texnum = record.texnums & 0xffff;
+    const uint32_t texnum_fb = record.texnums >> 16;
+    uint32_t c = record.color;
+    uint8_t* color_bytes = (uint8_t*)&c;
+
+    for (int k = 0; k < 4; k++) {
+        const uint32_t prim = primitive_offset + k;
+        for (int l = 0; l < 3; l++)
+            idx[3 * prim + l] = vertex_offset + faces[k][l];
+
+        VertexExtraData& extra = ext[prim];
+        extra.s_0 = merian::float_to_half(0);
+        extra.t_0 = merian::float_to_half(1);
+        extra.s_1 = merian::float_to_half(0);
+        extra.t_1 = merian::float_to_half(0);
+        extra.s_2 = merian::float_to_half(1);
+        extra.t_2 = merian::float_to_half(0);
+
+        if (texnum) {
+            // texture patch
+            const glm::vec3 n =
+                glm::normalize(glm::cross(vert[faces[k][2]] - vert[faces[k][0]],
+                                          vert[faces[k][1]] - vert[faces[k][0]]));
+            const uint32_t enc_n = merian::encode_normal(n);
+            extra.texnum_alpha = texnum;
+            extra.texnum_fb_flags = texnum_fb;
+            extra.n0_gloss_norm = enc_n;
+            extra.n1_brush = enc_n;
+            extra.n2 = enc_n;
+        } else {
+            // jitter the red channel
+            for (int i = 0; i < 3; i++)
+                color_bytes[0] =
+                    std::clamp(color_bytes[0] * (1 + rand.next() * 0.1f - 0.05f), 0.f, 255.f);
+
+            uint32_t c_fb = 0;
+            if (0.299f * color_bytes[0] + 0.587f * color_bytes[1] + 0.114f * color_bytes[2] >
+                150) {
+                c_fb = c; // bright colors are probably emitting
+            }
+
+            extra.texnum_alpha = 0;
+            extra.texnum_fb_flags = MAT_FLAGS_SOLID << 12;
+            extra.n0_gloss_norm = c;
+            extra.n1_brush = c_fb;
+            extra.n2 = 0;
+        }
+    }
+}
+
+uint32_t verify_particle_expansion(const uint32_t texnum_blood,
+                                   const uint32_t texnum_explosion,
+                                   const bool no_random,
+                                   const double prev_cl_time) {
+    std::vector<ParticleRecord> records;
+    make_particle_records(records, texnum_blood, texnum_explosion, no_random, prev_cl_time, 1.f,
+                          false);
+
+    const uint32_t count = records.size();
+    std::vector<float> ref_vtx(3 * 4 * count);
+    std::vector<float> ref_prev_vtx(3 * 4 * count);
+    std::vector<uint32_t> ref_idx(3 * 4 * count);
+    std::vector<VertexExtraData> ref_ext(4 * count);
+    for (uint32_t i = 0; i < count; i++) {
+        expand_particle_record(records[i], 4 * i, 4 * i, ref_vtx.data(), ref_prev_vtx.data(),
+                               ref_idx.data(), ref_ext.data());
+    }
+
+    std::vector<float> vtx;
+    std::vector<float> prev_vtx;
+    std::vector<uint32_t> idx;
+    std::vector<VertexExtraData> ext;
+    add_particles(vtx, prev_vtx, idx, ext, texnum_blood, texnum_explosion, no_random,
+                  prev_cl_time);
+
+    // add_particles advances the motion vector state, restore it afterwards.
+    {
+        uint32_t i = 0;
+        for (particle_t* p = active_particles; p && i < count; p = p->next, i++)
+            VectorCopy(&records[i].prev_origin.x, p->mv_prev_origin);
+    }
+
+    if (vtx.size() != ref_vtx.size() || idx.size() != ref_idx.size() ||
+        ext.size() != ref_ext.size()) {
+        return std::max<uint32_t>(1, ref_vtx.size() + ref_idx.size() + ref_ext.size());
+    }
+
+    uint32_t mismatches = 0;
+    for (std::size_t i = 0; i < vtx.size(); i++) {
+        mismatches += vtx[i] != ref_vtx[i];
+        mismatches += prev_vtx[i] != ref_prev_vtx[i];
+    }
+    for (std::size_t i = 0; i < idx.size(); i++) {
+        mismatches += idx[i] != ref_idx[i];
+    }
+    for (std::size_t i = 0; i < ext.size(); i++) {
+        const VertexExtraData& a = ext[i];
+        const VertexExtraData& b = ref_ext[i];
+        mismatches += a.texnum_alpha != b.texnum_alpha;
+        mismatches += a.texnum_fb_flags != b.texnum_fb_flags;
+        mismatches += a.s_0 != b.s_0 || a.t_0 != b.t_0 || a.s_1 != b.s_1 || a.t_1 != b.t_1 ||
+                      a.s_2 != b.s_2 || a.t_2 != b.t_2;
+        mismatches += a.n0_gloss_norm != b.n0_gloss_norm;
+        mismatches += a.n1_brush != b.n1_brush;
+        mismatches += a.n2 != b.n2;
+    }
+
+    return mismatches;
+}
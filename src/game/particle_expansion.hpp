@@ -0,0 +1,98 @@
+#pragma once
+
+#include "game/quake_helpers.hpp"
+
+#include <glm/glm.hpp>
+#include <vector>
+
+extern "C" {
+#include "quakedef.h"
+}
+
+// GPU expansion of particles.
+//
+// Instead of 4 vertices, 12 indices and 4 VertexExtraData per particle only a ParticleRecord is
+// uploaded which is expanded into a tetrahedron by shader/game/particle_expand.comp.
+// expand_particle_record is the CPU reference of that shader. add_particles uses the same record
+// and expansion, so both paths produce the same random shapes.
+
+// Must match ParticleRecord in particle_expand.comp (scalar layout).
+struct ParticleRecord {
+    glm::vec3 origin;
+    glm::vec3 prev_origin;
+    // see particle_scale and classify_particle
+    float scale;
+    // rotation in turns at cl.time and at the previous time, without the random offset
+    float rotation;
+    float prev_rotation;
+    // d_8to24table color
+    uint32_t color;
+    uint32_t seed;
+    // texnum | texnum_fb << 16, 0 for solid colored particles
+    uint32_t texnums;
+};
+
+// Must match the push constant of particle_expand.comp.
+struct ParticleExpandPushConstant {
+    uint32_t count;
+    // where the expanded geometry is written in the dynamic buffers
+    uint32_t vertex_offset;
+    uint32_t primitive_offset;
+};
+
+// merian::XORShift32 with float output and a scrambled seed, ported to particle_expand.comp. Its
+// double output cannot be reproduced on the GPU.
+struct ParticleRandom {
+    uint32_t state;
+
+    explicit ParticleRandom(const uint32_t seed) : state(seed * 747796405u + 2891336453u) {
+        if (state == 0)
+            state = 1;
+    }
+
+    // in [0, 1)
+    float next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (state >> 8) * (1.f / 16777216.f);
+    }
+};
+
+// Records the particle p. r_origin and vpn are the view origin and direction, see particle_scale.
+ParticleRecord make_particle_record(const particle_t* p,
+                                    const vec3_t r_origin,
+                                    const vec3_t vpn,
+                                    const uint32_t texnum_blood,
+                                    const uint32_t texnum_explosion,
+                                    const bool no_random,
+                                    const double prev_cl_time,
+                                    const float keep_probability);
+
+// Records the active particles that are kept with keep_probability, see add_particles. If
+// update_state is true the motion vector state of the particles is advanced like in add_particles.
+void make_particle_records(std::vector<ParticleRecord>& records,
+                           const uint32_t texnum_blood,
+                           const uint32_t texnum_explosion,
+                           const bool no_random,
+                           const double prev_cl_time,
+                           const float keep_probability = 1.f,
+                           const bool update_state = true);
+
+// CPU reference for particle_expand.comp. Writes the 4 vertices and 4 primitives of the particle to
+// vertex_offset and primitive_offset.
+void expand_particle_record(const ParticleRecord& record,
+                            const uint32_t vertex_offset,
+                            const uint32_t primitive_offset,
+                            float* vtx,
+                            float* prev_vtx,
+                            uint32_t* idx,
+                            VertexExtraData* ext);
+
+// Expands all active particles using the CPU reference and using add_particles and returns the
+// number of mismatching values. All vertices, indices and extra data must match exactly. The motion
+// vector state is not advanced.
+uint32_t verify_particle_expansion(const uint32_t texnum_blood,
+                                   const uint32_t texnum_explosion,
+                                   const bool no_random,
+                                   const double prev_cl_time);
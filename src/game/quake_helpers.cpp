@@ -1,16 +1,20 @@
 #include "quake_helpers.hpp"
 
 #include "../../res/shader/config.h"
+#include "alias_pose_cache.hpp"
+#include "particle_expansion.hpp"
+#include "vertex_transform.hpp"
 #include "glm/ext/matrix_transform.hpp"
 #include "merian/utils/bitpacking.hpp"
 #include "merian/utils/glm.hpp"
 #include "merian/utils/normal_encoding.hpp"
-#include "merian/utils/xorshift.hpp"
 
 #include <algorithm>
 #include <array>
+#include <cmath>
 #include <glm/glm.hpp>
 #include <mutex>
+#include <unordered_map>
 #include <vector>
 
 extern "C" {
@@ -47,209 +51,155 @@ uint16_t make_texnum_alpha(gltexture_s* tex, entity_t* entity, msurface_t* surfa
     return result;
 }
 
-void add_particles(std::vector<float>& vtx,
-                   std::vector<float>& prev_vtx,
-                   std::vector<uint32_t>& idx,
-                   std::vector<VertexExtraData>& ext,
-                   const uint32_t texnum_blood,
-                   const uint32_t texnum_explosion,
-                   const bool no_random,
-                   const double prev_cl_time) {
-
-    static const glm::vec3 voff[4] = {
-        {0.0, 1.0, 0.0},
-        {-0.5, -0.5, 0.87},
-        {-0.5, -0.5, -0.87},
-        {1.0, -0.5, 0.0},
-    };
+static std::array<TextureMaterial, MAX_GLTEXTURES> texture_materials;
 
-    vec3_t vpn, vright, vup, r_origin;
-    VectorCopy(r_refdef.vieworg, r_origin);
-    AngleVectors(r_refdef.viewangles, vpn, vright, vup);
+static TextureMaterial make_texture_material(gltexture_s* tex) {
+    return TextureMaterial{
+        .texture = tex,
+        .texnum_alpha = make_texnum_alpha(tex),
+        .waterfall = strstr(tex->name, "wfall") != nullptr,
+    };
+}
 
-    for (particle_t* p = active_particles; p; p = p->next) {
-        // from r_part.c
-        float scale = (p->org[0] - r_origin[0]) * vpn[0] + (p->org[1] - r_origin[1]) * vpn[1] +
-                      (p->org[2] - r_origin[2]) * vpn[2];
-        if (scale < 20)
-            scale = 1 + 0.08;
-        else
-            scale = 1 + scale * 0.004;
-
-        scale *= 0.5;
-
-        uint32_t c = d_8to24table[(int)p->color];
-        uint32_t seed = no_random ? static_cast<uint32_t>(p->die)
-                                  : static_cast<uint32_t>(reinterpret_cast<uint64_t>(p));
-        merian::XORShift32 xrand{seed};
-
-        // Some heuristics to improve blood, fire, explosions
-        uint32_t texnum = 0;
-        uint32_t texnum_fb = 0;
-        uint8_t* color_bytes = (uint8_t*)&c;
-
-        if (color_bytes[1] == 0 && color_bytes[2] == 0 && color_bytes[0] > 10) {
-            texnum = texnum_blood;
-        } else if (p->type == pt_explode2) {
-            texnum = texnum_explosion;
-            texnum_fb = texnum_explosion;
-            scale *= 2.0;
-        } else if (p->type == pt_fire &&
-                   (color_bytes[0] != color_bytes[1] || color_bytes[1] != color_bytes[2] ||
-                    color_bytes[0] != color_bytes[2])) {
-            texnum = texnum_explosion;
-            texnum_fb = texnum_explosion;
-            scale *= 2.0;
-        } else if (0.299 * color_bytes[0] + 0.587 * color_bytes[1] + 0.114 * color_bytes[2] > 200) {
-            // very bright colors are probably fire
-            texnum = texnum_explosion;
-            texnum_fb = texnum_explosion;
-            scale *= 2.0;
-        }
+void update_texture_material(gltexture_s* tex) {
+    if (tex->texnum < MAX_GLTEXTURES)
+        texture_materials[tex->texnum] = make_texture_material(tex);
+}
 
-        glm::vec3 vert[4];
-        glm::vec3 prev_vert[4];
-        for (int l = 0; l < 3; l++) {
-            const float particle_offset =
-                2 * (xrand.next_double() - 0.5) + 2 * (xrand.next_double() - 0.5);
-            const double rand_angle = xrand.next_double();
-            const glm::vec3 rand_v = glm::normalize(
-                glm::vec3(xrand.next_double(), xrand.next_double(), xrand.next_double()));
-
-            const glm::mat4 rotation = glm::rotate<float>(
-                glm::identity<glm::mat4>(),
-                (rand_angle + cl.time * 0.001 * glm::length(*merian::as_vec3(p->vel))) * 2 * M_PI,
-                rand_v);
-            const glm::mat4 prev_rotation = glm::rotate<float>(
-                glm::identity<glm::mat4>(),
-                (rand_angle + prev_cl_time * 0.001 * glm::length(*merian::as_vec3(p->vel))) * 2 *
-                    M_PI,
-                rand_v);
-            for (int k = 0; k < 4; k++) {
-                const float vertex_offset =
-                    0.5 * ((xrand.next_double() - 0.5) + (xrand.next_double() - 0.5));
-                const float rand_offset_scale = (float)xrand.next_double();
-
-                vert[k] = *merian::as_vec3(p->org) + particle_offset +
-                          glm::vec3(rotation * glm::vec4(scale * voff[k] * (1 + rand_offset_scale) +
-                                                             vertex_offset,
-                                                         1));
-                prev_vert[k] =
-                    *merian::as_vec3(p->mv_prev_origin) + particle_offset +
-                    glm::vec3(
-                        prev_rotation *
-                        glm::vec4(scale * voff[k] * (1 + rand_offset_scale) + vertex_offset, 1));
-            }
-        }
+TextureMaterial get_texture_material(gltexture_s* tex) {
+    if (tex->texnum < MAX_GLTEXTURES && texture_materials[tex->texnum].texture == tex)
+        return texture_materials[tex->texnum];
+    return make_texture_material(tex);
+}
 
-        VectorCopy(p->org, p->mv_prev_origin);
+float particle_scale(const particle_t* p, const vec3_t r_origin, const vec3_t vpn) {
+    // from r_part.c
+    float scale = (p->org[0] - r_origin[0]) * vpn[0] + (p->org[1] - r_origin[1]) * vpn[1] +
+                  (p->org[2] - r_origin[2]) * vpn[2];
+    if (scale < 20)
+        scale = 1 + 0.08;
+    else
+        scale = 1 + scale * 0.004;
+
+    scale *= 0.5;
+    return scale;
+}
 
-        const uint32_t vtx_cnt = vtx.size() / 3;
-        for (int l = 0; l < 3; l++) {
-            vtx.emplace_back(vert[0][l]);
-            prev_vtx.emplace_back(prev_vert[0][l]);
-        }
-        for (int l = 0; l < 3; l++) {
-            vtx.emplace_back(vert[1][l]);
-            prev_vtx.emplace_back(prev_vert[1][l]);
-        }
-        for (int l = 0; l < 3; l++) {
-            vtx.emplace_back(vert[2][l]);
-            prev_vtx.emplace_back(prev_vert[2][l]);
-        }
-        for (int l = 0; l < 3; l++) {
-            vtx.emplace_back(vert[3][l]);
-            prev_vtx.emplace_back(prev_vert[3][l]);
-        }
+uint32_t particle_seed(const particle_t* p, const bool no_random) {
+    return no_random ? static_cast<uint32_t>(p->die)
+                     : static_cast<uint32_t>(reinterpret_cast<uint64_t>(p));
+}
 
-        const uint32_t idx_size = idx.size();
+void classify_particle(const particle_t* p,
+                       const uint32_t color,
+                       const uint32_t texnum_blood,
+                       const uint32_t texnum_explosion,
+                       uint32_t& texnum,
+                       uint32_t& texnum_fb,
+                       float& scale) {
+    // Some heuristics to improve blood, fire, explosions
+    texnum = 0;
+    texnum_fb = 0;
+    const uint8_t* color_bytes = (const uint8_t*)&color;
+
+    if (color_bytes[1] == 0 && color_bytes[2] == 0 && color_bytes[0] > 10) {
+        texnum = texnum_blood;
+    } else if (p->type == pt_explode2) {
+        texnum = texnum_explosion;
+        texnum_fb = texnum_explosion;
+        scale *= 2.0;
+    } else if (p->type == pt_fire &&
+               (color_bytes[0] != color_bytes[1] || color_bytes[1] != color_bytes[2] ||
+                color_bytes[0] != color_bytes[2])) {
+        texnum = texnum_explosion;
+        texnum_fb = texnum_explosion;
+        scale *= 2.0;
+    } else if (0.299 * color_bytes[0] + 0.587 * color_bytes[1] + 0.114 * color_bytes[2] > 200) {
+        // very bright colors are probably fire
+        texnum = texnum_explosion;
+        texnum_fb = texnum_explosion;
+        scale *= 2.0;
+    }
+}
 
-        idx.emplace_back(vtx_cnt);
-        idx.emplace_back(vtx_cnt + 1);
-        idx.emplace_back(vtx_cnt + 2);
+uint32_t count_particles() {
+    uint32_t count = 0;
+    for (particle_t* p = active_particles; p; p = p->next)
+        count++;
+    return count;
+}
 
-        idx.emplace_back(vtx_cnt);
-        idx.emplace_back(vtx_cnt + 2);
-        idx.emplace_back(vtx_cnt + 3);
+float particle_keep_probability(const uint32_t particle_count, const uint32_t budget) {
+    if (budget == 0 || particle_count <= budget)
+        return 1.f;
+    return budget / (float)particle_count;
+}
 
-        idx.emplace_back(vtx_cnt);
-        idx.emplace_back(vtx_cnt + 3);
-        idx.emplace_back(vtx_cnt + 1);
+bool keep_particle(const particle_t* p, const bool no_random, const float keep_probability) {
+    if (keep_probability >= 1.f)
+        return true;
 
-        idx.emplace_back(vtx_cnt + 1);
-        idx.emplace_back(vtx_cnt + 3);
-        idx.emplace_back(vtx_cnt + 2);
+    // PCG hash of the seed, the same particles are kept as long as the probability does not change
+    const uint32_t state = particle_seed(p, no_random) * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    word = (word >> 22u) ^ word;
+    return (word >> 8) * (1.f / 16777216.f) < keep_probability;
+}
 
-        // regular particle
-        for (int k = 0; k < 4; k++) {
-            if (texnum) {
-                // texture patch
-                const glm::vec3 n = glm::normalize(
-                    glm::cross(*merian::as_vec3(&vtx[3 * idx[idx_size + 3 * k + 2]]) -
-                                   *merian::as_vec3(&vtx[3 * idx[idx_size + 3 * k]]),
-                               *merian::as_vec3(&vtx[3 * idx[idx_size + 3 * k + 1]]) -
-                                   *merian::as_vec3(&vtx[3 * idx[idx_size + 3 * k]])));
-                const uint32_t enc_n = merian::encode_normal(n);
-
-                ext.emplace_back(texnum, texnum_fb, enc_n, enc_n, enc_n, merian::float_to_half(0),
-                                 merian::float_to_half(1), merian::float_to_half(0),
-                                 merian::float_to_half(0), merian::float_to_half(1),
-                                 merian::float_to_half(0));
-            } else {
-                for (int i = 0; i < 3; i++)
-                    color_bytes[0] = std::clamp(
-                        color_bytes[0] * (1 + xrand.next_double() * 0.1 - 0.05), 0., 255.);
-
-                uint32_t c_fb = 0;
-                if (0.299 * color_bytes[0] + 0.587 * color_bytes[1] + 0.114 * color_bytes[2] >
-                    150) {
-                    c_fb = c; // bright colors are probably emitting
-                }
+uint32_t add_particles(std::vector<float>& vtx,
+                       std::vector<float>& prev_vtx,
+                       std::vector<uint32_t>& idx,
+                       std::vector<VertexExtraData>& ext,
+                       const uint32_t texnum_blood,
+                       const uint32_t texnum_explosion,
+                       const bool no_random,
+                       const double prev_cl_time,
+                       const float keep_probability) {
+    vec3_t vpn, vright, vup, r_origin;
+    VectorCopy(r_refdef.vieworg, r_origin);
+    AngleVectors(r_refdef.viewangles, vpn, vright, vup);
 
-                ext.emplace_back(0, 0 | (MAT_FLAGS_SOLID << 12), c, c_fb, 0,
-                                 merian::float_to_half(0), merian::float_to_half(1),
-                                 merian::float_to_half(0), merian::float_to_half(0),
-                                 merian::float_to_half(1), merian::float_to_half(0));
-            }
+    uint32_t kept = 0;
+    for (particle_t* p = active_particles; p; p = p->next) {
+        if (!keep_particle(p, no_random, keep_probability)) {
+            VectorCopy(p->org, p->mv_prev_origin);
+            continue;
         }
-    }
-}
+        kept++;
 
-void add_geo_alias(entity_t* ent,
-                   [[maybe_unused]] qmodel_t* m,
-                   std::vector<float>& vtx,
-                   std::vector<float>& prev_vtx,
-                   std::vector<uint32_t>& idx,
-                   std::vector<VertexExtraData>& ext) {
-    assert(m->type == mod_alias);
-
-    static std::mutex quake_mutex;
-    // An internal cache shifts the hdr pointer... :/
-    std::lock_guard<std::mutex> lock(quake_mutex);
+        // the same shape as the GPU expansion
+        const ParticleRecord record =
+            make_particle_record(p, r_origin, vpn, texnum_blood, texnum_explosion, no_random,
+                                 prev_cl_time, keep_probability);
+        VectorCopy(p->org, p->mv_prev_origin);
 
-    // TODO: e->model->flags & MF_HOLEY <= enable alpha test
-    // fprintf(stderr, "alias origin and angles %g %g %g -- %g %g %g\n",
-    //     ent->origin[0], ent->origin[1], ent->origin[2],
-    //     ent->angles[0], ent->angles[1], ent->angles[2]);
+        const uint32_t vtx_cnt = vtx.size() / 3;
+        const uint32_t prim_cnt = ext.size();
+        vtx.resize(vtx.size() + 3 * 4);
+        prev_vtx.resize(prev_vtx.size() + 3 * 4);
+        idx.resize(idx.size() + 3 * 4);
+        ext.resize(ext.size() + 4);
+        expand_particle_record(record, vtx_cnt, prim_cnt, vtx.data(), prev_vtx.data(), idx.data(),
+                               ext.data());
+    }
 
-    aliashdr_t* hdr = (aliashdr_t*)Mod_Extradata(ent->model);
-    aliasmesh_t* desc = (aliasmesh_t*)((uint8_t*)hdr + hdr->meshdesc);
-    // the plural here really hurts but it's from quakespasm code:
-    int16_t* indexes = (int16_t*)((uint8_t*)hdr + hdr->indexes);
-    trivertx_t* trivertexes = (trivertx_t*)((uint8_t*)hdr + hdr->vertexes);
+    return kept;
+}
 
-    // for(int f = 0; f < hdr->numposes; f++)
-    // TODO: upload all vertices so we can just alter the indices on gpu
-    int f = ent->frame;
-    if (f < 0 || f >= hdr->numposes)
-        return;
+// An internal cache shifts the hdr pointer... :/
+std::mutex alias_hdr_mutex;
 
+void setup_alias_transforms(entity_t* ent,
+                            aliashdr_t* hdr,
+                            lerpdata_t& lerpdata,
+                            glm::mat4& mat_model,
+                            glm::mat4& mat_prev_model) {
     // makes gun fov independent
     glm::vec3 fovscale(1.);
     if (ent == &cl.viewent && scr_fov.value > 90.f && cl_gun_fovscale.value)
         fovscale.y = fovscale.z = tan(scr_fov.value * (0.5f * M_PI / 180.f));
 
-    glm::mat4 mat_prev_model = glm::identity<glm::mat4>();
+    mat_prev_model = glm::identity<glm::mat4>();
     AngleVectors(ent->mv_prev_angles, &mat_prev_model[0].x, &mat_prev_model[1].x,
                  &mat_prev_model[2].x);
     mat_prev_model[3] = glm::vec4(*merian::as_vec3(ent->mv_prev_origin), 1);
@@ -262,14 +212,12 @@ void add_geo_alias(entity_t* ent,
     mat_prev_model = mat_prev_model * glm::scale(glm::identity<glm::mat4>(),
                                                  *merian::as_vec3(hdr->scale) * fovscale);
 
-    lerpdata_t lerpdata;
     R_SetupAliasFrame(ent, hdr, ent->frame, &lerpdata);
     R_SetupEntityTransform(ent, &lerpdata);
 
     // angles: pitch yaw roll. axes: right fwd up
     lerpdata.angles[0] *= -1;
-    glm::mat4 mat_model = glm::identity<glm::mat4>();
-    glm::vec3 pos_pose1, pos_pose2;
+    mat_model = glm::identity<glm::mat4>();
 
     AngleVectors(lerpdata.angles, &mat_model[0].x, &mat_model[1].x, &mat_model[2].x);
     mat_model[3] = glm::vec4(*merian::as_vec3(lerpdata.origin), 1);
@@ -280,101 +228,168 @@ void add_geo_alias(entity_t* ent,
                                            *merian::as_vec3(hdr->scale_origin) * fovscale);
     mat_model =
         mat_model * glm::scale(glm::identity<glm::mat4>(), *merian::as_vec3(hdr->scale) * fovscale);
+}
 
-    const glm::mat3 mat_model_inv_t = glm::transpose(glm::inverse(mat_model));
+bool resolve_alias_model(entity_t* ent, ResolvedAliasModel& resolved) {
+    resolved = {};
+    if (!ent || !ent->model || ent->model->type != mod_alias)
+        return false;
 
-    uint32_t vtx_cnt = vtx.size() / 3;
-    for (int v = 0; v < hdr->numverts_vbo; v++) {
-        int i_pose1 = hdr->numverts * lerpdata.pose1 + desc[v].vertindex;
-        int i_pose2 = hdr->numverts * lerpdata.pose2 + desc[v].vertindex;
-        // get model pos
-        for (int k = 0; k < 3; k++) {
-            pos_pose1[k] = trivertexes[i_pose1].v[k];
-            pos_pose2[k] = trivertexes[i_pose2].v[k];
-        }
-        // convert to world space
-        const glm::vec3 world_pos =
-            mat_model * glm::vec4(glm::mix(pos_pose1, pos_pose2, lerpdata.blend), 1.0);
-        for (int k = 0; k < 3; k++)
-            vtx.emplace_back(world_pos[k]);
-
-        const glm::vec3 old_world_pos =
-            mat_prev_model * glm::vec4(glm::mix(pos_pose1, pos_pose2, ent->mv_prev_blend), 1.0);
-        for (int k = 0; k < 3; k++)
-            prev_vtx.emplace_back(old_world_pos[k]);
+    std::lock_guard<std::mutex> lock(alias_hdr_mutex);
+    resolved.hdr = (aliashdr_t*)Mod_Extradata(ent->model);
+    resolved.cache = &get_alias_pose_cache(ent->model, resolved.hdr);
+    return true;
+}
+
+void setup_alias_transforms(entity_t* ent, ResolvedAliasModel& resolved) {
+    if (resolved.has_transforms)
+        return;
+    setup_alias_transforms(ent, resolved.hdr, resolved.lerpdata, resolved.mat_model,
+                           resolved.mat_prev_model);
+    resolved.has_transforms = true;
+}
+
+void add_geo_alias(entity_t* ent,
+                   [[maybe_unused]] qmodel_t* m,
+                   std::vector<float>& vtx,
+                   std::vector<float>& prev_vtx,
+                   std::vector<uint32_t>& idx,
+                   std::vector<VertexExtraData>& ext) {
+    assert(m->type == mod_alias);
+
+    // the header must not move while it is used
+    std::lock_guard<std::mutex> lock(alias_hdr_mutex);
+    ResolvedAliasModel resolved;
+    resolved.hdr = (aliashdr_t*)Mod_Extradata(ent->model);
+    resolved.cache = &get_alias_pose_cache(ent->model, resolved.hdr);
+    add_geo_alias(ent, resolved, vtx, prev_vtx, idx, ext);
+}
+
+void add_geo_alias(entity_t* ent,
+                   ResolvedAliasModel& resolved,
+                   std::vector<float>& vtx,
+                   std::vector<float>& prev_vtx,
+                   std::vector<uint32_t>& idx,
+                   std::vector<VertexExtraData>& ext) {
+    // TODO: e->model->flags & MF_HOLEY <= enable alpha test
+    // fprintf(stderr, "alias origin and angles %g %g %g -- %g %g %g\n",
+    //     ent->origin[0], ent->origin[1], ent->origin[2],
+    //     ent->angles[0], ent->angles[1], ent->angles[2]);
+
+    aliashdr_t* hdr = resolved.hdr;
+
+    int f = ent->frame;
+    if (f < 0 || f >= hdr->numposes)
+        return;
+
+    const AliasPoseCache& cache = *resolved.cache;
+
+    setup_alias_transforms(ent, resolved);
+    const lerpdata_t& lerpdata = resolved.lerpdata;
+    const glm::mat4& mat_model = resolved.mat_model;
+    const glm::mat4& mat_prev_model = resolved.mat_prev_model;
+
+    const uint32_t numverts_vbo = cache.numverts_vbo;
+    const uint32_t numprims = cache.numindexes / 3;
+    const uint32_t vtx_cnt = vtx.size() / 3;
+    const uint32_t idx_size = idx.size();
+    const uint32_t ext_size = ext.size();
+    vtx.resize(vtx.size() + 3 * numverts_vbo);
+    prev_vtx.resize(prev_vtx.size() + 3 * numverts_vbo);
+    idx.resize(idx.size() + cache.numindexes);
+    ext.resize(ext.size() + numprims);
+
+    // lerp and convert to world space
+    {
+        const std::size_t offset_pose1 = (std::size_t)numverts_vbo * lerpdata.pose1;
+        const std::size_t offset_pose2 = (std::size_t)numverts_vbo * lerpdata.pose2;
+        const SoAPositions pose1{cache.x.data() + offset_pose1, cache.y.data() + offset_pose1,
+                                 cache.z.data() + offset_pose1};
+        const SoAPositions pose2{cache.x.data() + offset_pose2, cache.y.data() + offset_pose2,
+                                 cache.z.data() + offset_pose2};
+        lerp_transform_positions_2(pose1, pose2, numverts_vbo, lerpdata.blend, mat_model,
+                                   ent->mv_prev_blend, mat_prev_model, vtx.data() + 3 * vtx_cnt,
+                                   prev_vtx.data() + 3 * vtx_cnt);
     }
 
     ent->mv_prev_blend = lerpdata.blend;
     VectorCopy(lerpdata.angles, ent->mv_prev_angles);
     VectorCopy(lerpdata.origin, ent->mv_prev_origin);
 
-    for (int i = 0; i < hdr->numindexes; i++)
-        idx.emplace_back(vtx_cnt + indexes[i]);
-
-    // normals for each vertex from above
-    std::vector<uint32_t> tmpn(hdr->numverts_vbo);
-    for (int v = 0; v < hdr->numverts_vbo; v++) {
-        int i_pose1 = hdr->numverts * lerpdata.pose1 + desc[v].vertindex;
-        int i_pose2 = hdr->numverts * lerpdata.pose2 + desc[v].vertindex;
-        const glm::vec3* n_pose1 =
-            merian::as_vec3(r_avertexnormals[trivertexes[i_pose1].lightnormalindex]);
-        const glm::vec3* n_pose2 =
-            merian::as_vec3(r_avertexnormals[trivertexes[i_pose2].lightnormalindex]);
-        // convert to worldspace
-        const glm::vec3 world_n =
-            glm::normalize(mat_model_inv_t * glm::mix(*n_pose1, *n_pose2, lerpdata.blend));
-        tmpn[v] = merian::encode_normal(world_n);
-    }
+    for (uint32_t i = 0; i < cache.numindexes; i++)
+        idx[idx_size + i] = vtx_cnt + cache.indexes[i];
+
+    const int sk = glm::clamp(ent->skinnum, 0, hdr->numskins - 1),
+              fm = ((int)(cl.time * 10)) & 3;
+    const uint16_t texnum_alpha = make_texnum_alpha(hdr->gltextures[sk][fm]);
+    const uint16_t fb_texnum = hdr->fbtextures[sk][fm] ? hdr->fbtextures[sk][fm]->texnum : 0;
 
     // add extra data for each primitive
-    for (int i = 0; i < hdr->numindexes / 3; i++) {
-        const int sk = glm::clamp(ent->skinnum, 0, hdr->numskins - 1),
-                  fm = ((int)(cl.time * 10)) & 3;
-        const uint16_t texnum_alpha = make_texnum_alpha(hdr->gltextures[sk][fm]);
-        const uint16_t fb_texnum = hdr->fbtextures[sk][fm] ? hdr->fbtextures[sk][fm]->texnum : 0;
-
-        uint32_t n0, n1, n2;
-        if (hdr->nmtextures[sk][fm]) {
-            // this discards the vertex normals
-            n0 = merian::pack_uint32(hdr->gstextures[sk][fm] ? hdr->gstextures[sk][fm]->texnum : 0,
-                                     hdr->nmtextures[sk][fm]->texnum);
-            n1 = 0xffffffff; // mark as brush model -> to use normal map
-            n2 = 0;
-        } else {
-            // the vertex normals
-            n0 = tmpn[indexes[3 * i + 0]];
-            n1 = tmpn[indexes[3 * i + 1]];
-            n2 = tmpn[indexes[3 * i + 2]];
+    VertexExtraData* out_ext = ext.data() + ext_size;
+    if (hdr->nmtextures[sk][fm]) {
+        // this discards the vertex normals
+        const uint32_t gloss_norm =
+            merian::pack_uint32(hdr->gstextures[sk][fm] ? hdr->gstextures[sk][fm]->texnum : 0,
+                                hdr->nmtextures[sk][fm]->texnum);
+        for (uint32_t i = 0; i < numprims; i++) {
+            out_ext[i].n0_gloss_norm = gloss_norm;
+            out_ext[i].n1_brush = 0xffffffff; // mark as brush model -> to use normal map
+            out_ext[i].n2 = 0;
+        }
+    } else {
+        // normals for each vertex, the scratch buffer is reused to prevent allocations
+        thread_local std::vector<uint32_t> tmpn;
+        tmpn.resize(numverts_vbo);
+
+        const std::size_t offset_pose1 = (std::size_t)numverts_vbo * lerpdata.pose1;
+        const std::size_t offset_pose2 = (std::size_t)numverts_vbo * lerpdata.pose2;
+        const float* nx1 = cache.nx.data() + offset_pose1;
+        const float* ny1 = cache.ny.data() + offset_pose1;
+        const float* nz1 = cache.nz.data() + offset_pose1;
+        const float* nx2 = cache.nx.data() + offset_pose2;
+        const float* ny2 = cache.ny.data() + offset_pose2;
+        const float* nz2 = cache.nz.data() + offset_pose2;
+
+        const float blend = lerpdata.blend;
+        const glm::mat3 mat_model_inv_t = glm::transpose(glm::inverse(mat_model));
+        for (uint32_t v = 0; v < numverts_vbo; v++) {
+            const glm::vec3 n(nx1[v] * (1.f - blend) + nx2[v] * blend,
+                              ny1[v] * (1.f - blend) + ny2[v] * blend,
+                              nz1[v] * (1.f - blend) + nz2[v] * blend);
+            // convert to worldspace
+            tmpn[v] = merian::encode_normal(glm::normalize(mat_model_inv_t * n));
         }
 
-        ext.emplace_back(
-            texnum_alpha, fb_texnum, n0, n1, n2,
-            merian::float_to_half((desc[indexes[3 * i + 0]].st[0] + 0.5) / (float)hdr->skinwidth),
-            merian::float_to_half((desc[indexes[3 * i + 0]].st[1] + 0.5) / (float)hdr->skinheight),
-            merian::float_to_half((desc[indexes[3 * i + 1]].st[0] + 0.5) / (float)hdr->skinwidth),
-            merian::float_to_half((desc[indexes[3 * i + 1]].st[1] + 0.5) / (float)hdr->skinheight),
-            merian::float_to_half((desc[indexes[3 * i + 2]].st[0] + 0.5) / (float)hdr->skinwidth),
-            merian::float_to_half((desc[indexes[3 * i + 2]].st[1] + 0.5) / (float)hdr->skinheight));
+        for (uint32_t i = 0; i < numprims; i++) {
+            out_ext[i].n0_gloss_norm = tmpn[cache.indexes[3 * i + 0]];
+            out_ext[i].n1_brush = tmpn[cache.indexes[3 * i + 1]];
+            out_ext[i].n2 = tmpn[cache.indexes[3 * i + 2]];
+        }
     }
-}
 
-// geo_selector: 0 -> all, 1 -> opaque, 2 -> transparent
-void add_geo_brush(entity_t* ent,
-                   qmodel_t* m,
-                   std::vector<float>& vtx,
-                   std::vector<float>& prev_vtx,
-                   std::vector<uint32_t>& idx,
-                   std::vector<VertexExtraData>& ext,
-                   int geo_selector) {
-    assert(m->type == mod_brush);
+    for (uint32_t i = 0; i < numprims; i++) {
+        const uint32_t i0 = cache.indexes[3 * i + 0];
+        const uint32_t i1 = cache.indexes[3 * i + 1];
+        const uint32_t i2 = cache.indexes[3 * i + 2];
+        out_ext[i].texnum_alpha = texnum_alpha;
+        out_ext[i].texnum_fb_flags = fb_texnum;
+        out_ext[i].s_0 = cache.s[i0];
+        out_ext[i].t_0 = cache.t[i0];
+        out_ext[i].s_1 = cache.s[i1];
+        out_ext[i].t_1 = cache.t[i1];
+        out_ext[i].s_2 = cache.s[i2];
+        out_ext[i].t_2 = cache.t[i2];
+    }
+}
 
+void setup_brush_transforms(entity_t* ent, glm::mat4& mat_model, glm::mat4& mat_prev_model) {
     std::array<float, 3> angles = {-ent->angles[0], ent->angles[1], ent->angles[2]};
-    glm::mat4 mat_model = glm::identity<glm::mat4>();
+    mat_model = glm::identity<glm::mat4>();
     AngleVectors(angles.data(), &mat_model[0].x, &mat_model[1].x, &mat_model[2].x);
     mat_model[1] *= -1;
     VectorCopy(ent->origin, &mat_model[3].x);
 
-    glm::mat4 mat_prev_model = glm::identity<glm::mat4>();
+    mat_prev_model = glm::identity<glm::mat4>();
     std::array<float, 3> prev_angles = {-ent->mv_prev_angles[0], ent->mv_prev_angles[1],
                                         ent->mv_prev_angles[2]};
     AngleVectors(prev_angles.data(), &mat_prev_model[0].x, &mat_prev_model[1].x,
@@ -384,83 +399,145 @@ void add_geo_brush(entity_t* ent,
 
     VectorCopy(ent->origin, ent->mv_prev_origin);
     VectorCopy(ent->angles, ent->mv_prev_angles);
+}
+
+bool brush_model_has_animated_textures(qmodel_t* m) {
+    assert(m->type == mod_brush);
 
     for (int i = 0; i < m->nummodelsurfaces; i++) {
+        const texture_t* t = m->surfaces[m->firstmodelsurface + i].texinfo->texture;
+        if (t->anim_total || t->alternate_anims)
+            return true;
+    }
+    return false;
+}
+
+bool static_entity_animates(entity_t* ent) {
+    qmodel_t* m = ent->model;
+    if (!m)
+        return false;
+
+    if (m->type == mod_alias) {
+        std::lock_guard<std::mutex> lock(alias_hdr_mutex);
+        const aliashdr_t* hdr = (aliashdr_t*)Mod_Extradata(m);
+        // same fallback as R_SetupAliasFrame
+        const int frame = (ent->frame >= hdr->numframes || ent->frame < 0) ? 0 : ent->frame;
+        if (hdr->frames[frame].numposes > 1)
+            return true;
+        // skin groups, see add_geo_alias
+        const int sk = glm::clamp(ent->skinnum, 0, hdr->numskins - 1);
+        for (int fm = 1; fm < 4; fm++) {
+            if (hdr->gltextures[sk][fm] != hdr->gltextures[sk][0] ||
+                hdr->fbtextures[sk][fm] != hdr->fbtextures[sk][0])
+                return true;
+        }
+        return false;
+    }
+    if (m->type == mod_brush) {
+        return brush_model_has_animated_textures(m);
+    }
+
+    // sprites
+    return true;
+}
+
+void add_geo_brush_surfaces(qmodel_t* m,
+                            const glm::mat4& mat_model,
+                            const glm::mat4& mat_prev_model,
+                            const int frame,
+                            const int surface_begin,
+                            const int surface_end,
+                            const GeometryOutput& opaque,
+                            const GeometryOutput& alpha) {
+    assert(m->type == mod_brush);
+
+    for (int i = surface_begin; i < surface_end; i++) {
         msurface_t* surf = &m->surfaces[m->firstmodelsurface + i];
+        texture_t* base_texture = surf->texinfo->texture;
 
-        if (!strcmp(surf->texinfo->texture->name, "skip"))
+        if (!strcmp(base_texture->name, "skip"))
             continue;
 
         // TODO: make somehow dynamic. don't want to re-upload the whole model just because
         // the texture animates. for now that means static brush models will not actually
         // animate their textures
-        texture_t* t = R_TextureAnimation(surf->texinfo->texture, ent->frame);
-
-        if (geo_selector == 1 && t->gltexture && (t->gltexture->flags & TEXPREF_ALPHA)) {
-            continue;
-        }
-        if (geo_selector == 2 && (!t->gltexture || (t->gltexture->flags & TEXPREF_ALPHA) == 0)) {
-            continue;
+        texture_t* t = R_TextureAnimation(base_texture, frame);
+
+        const bool alpha_tested = t->gltexture && (t->gltexture->flags & TEXPREF_ALPHA);
+        std::vector<float>& vtx = alpha_tested ? alpha.vtx : opaque.vtx;
+        std::vector<float>& prev_vtx = alpha_tested ? alpha.prev_vtx : opaque.prev_vtx;
+        std::vector<uint32_t>& idx = alpha_tested ? alpha.idx : opaque.idx;
+        std::vector<VertexExtraData>& ext = alpha_tested ? alpha.ext : opaque.ext;
+
+        // everything except the texture coordinates is the same for all primitives of the surface
+        VertexExtraData surface_extra{
+            .texnum_alpha = 0,
+            .texnum_fb_flags = 0,
+            .n0_gloss_norm = merian::pack_uint32(t->gloss ? t->gloss->texnum : 0,
+                                                 t->norm ? t->norm->texnum : 0),
+            .n1_brush = 0xffffffff,
+            .n2 = 0,
+        };
+        uint32_t flags = MAT_FLAGS_NONE;
+        if (base_texture->gltexture) {
+            const TextureMaterial material = get_texture_material(t->gltexture);
+            surface_extra.texnum_alpha = material.texnum_alpha;
+            surface_extra.texnum_fb_flags = t->fullbright ? t->fullbright->texnum : 0;
+
+            if (surf->flags & SURF_DRAWLAVA)
+                flags = MAT_FLAGS_LAVA;
+            if (surf->flags & SURF_DRAWSLIME)
+                flags = MAT_FLAGS_SLIME;
+            if (surf->flags & SURF_DRAWTELE)
+                flags = MAT_FLAGS_TELE;
+            if (surf->flags & SURF_DRAWWATER)
+                flags = MAT_FLAGS_WATER;
+            if (material.waterfall)
+                flags = MAT_FLAGS_WATERFALL; // hack for ad_tears and emissive waterfalls
         }
+        if (surf->flags & SURF_DRAWSKY)
+            flags = MAT_FLAGS_SKY;
+        // max textures is 4096 (12 bit) and we have 16. so we can put 4 bits
+        // worth of flags here:
+        surface_extra.texnum_fb_flags |= flags << 12;
 
         glpoly_t* p = surf->polys;
         while (p) {
-            uint32_t vtx_cnt = vtx.size() / 3;
-            for (int k = 0; k < p->numverts; k++) {
-                const glm::vec3 coord = mat_model * glm::vec4(*merian::as_vec3(p->verts[k]), 1.0);
-                const glm::vec3 prev_coord =
-                    mat_prev_model * glm::vec4(*merian::as_vec3(p->verts[k]), 1.0);
-
-                for (int l = 0; l < 3; l++) {
-                    vtx.emplace_back(coord[l]);
-                    prev_vtx.emplace_back(prev_coord[l]);
-                }
+            const uint32_t vtx_cnt = vtx.size() / 3;
+            vtx.resize(vtx.size() + 3 * p->numverts);
+            prev_vtx.resize(prev_vtx.size() + 3 * p->numverts);
+            transform_positions_2(p->verts[0], VERTEXSIZE, p->numverts, mat_model, mat_prev_model,
+                                  vtx.data() + 3 * vtx_cnt, prev_vtx.data() + 3 * vtx_cnt);
+
+            const uint32_t idx_size = idx.size();
+            idx.resize(idx_size + 3 * std::max(p->numverts - 2, 0));
+            uint32_t* out_idx = idx.data() + idx_size;
+            for (int k = 2; k < p->numverts; k++) {
+                *(out_idx++) = vtx_cnt;
+                *(out_idx++) = vtx_cnt + k - 1;
+                *(out_idx++) = vtx_cnt + k;
             }
 
-            for (int k = 2; k < p->numverts; k++) {
-                idx.emplace_back(vtx_cnt);
-                idx.emplace_back(vtx_cnt + k - 1);
-                idx.emplace_back(vtx_cnt + k);
+            // texture coordinates for each vertex
+            thread_local std::vector<uint16_t> s_half;
+            thread_local std::vector<uint16_t> t_half;
+            if (base_texture->gltexture) {
+                s_half.resize(p->numverts);
+                t_half.resize(p->numverts);
+                floats_to_halfs(&p->verts[0][3], VERTEXSIZE, p->numverts, s_half.data());
+                floats_to_halfs(&p->verts[0][4], VERTEXSIZE, p->numverts, t_half.data());
             }
 
             for (int k = 2; k < p->numverts; k++) {
-                VertexExtraData extra{
-                    .texnum_alpha = 0,
-                    .texnum_fb_flags = 0,
-                    .n0_gloss_norm = merian::pack_uint32(t->gloss ? t->gloss->texnum : 0,
-                                                         t->norm ? t->norm->texnum : 0),
-                    .n1_brush = 0xffffffff,
-                    .n2 = 0,
-                };
-                uint32_t flags = MAT_FLAGS_NONE;
-                if (surf->texinfo->texture->gltexture) {
-                    extra.s_0 = merian::float_to_half(p->verts[0][3]);
-                    extra.t_0 = merian::float_to_half(p->verts[0][4]);
-                    extra.s_1 = merian::float_to_half(p->verts[k - 1][3]);
-                    extra.t_1 = merian::float_to_half(p->verts[k - 1][4]);
-                    extra.s_2 = merian::float_to_half(p->verts[k - 0][3]);
-                    extra.t_2 = merian::float_to_half(p->verts[k - 0][4]);
-                    extra.texnum_alpha = make_texnum_alpha(t->gltexture, ent, surf);
-                    extra.texnum_fb_flags = t->fullbright ? t->fullbright->texnum : 0;
-
-                    if (surf->flags & SURF_DRAWLAVA)
-                        flags = MAT_FLAGS_LAVA;
-                    if (surf->flags & SURF_DRAWSLIME)
-                        flags = MAT_FLAGS_SLIME;
-                    if (surf->flags & SURF_DRAWTELE)
-                        flags = MAT_FLAGS_TELE;
-                    if (surf->flags & SURF_DRAWWATER)
-                        flags = MAT_FLAGS_WATER;
-                    if (strstr(t->gltexture->name, "wfall"))
-                        flags = MAT_FLAGS_WATERFALL; // hack for ad_tears and emissive waterfalls
+                VertexExtraData& extra = ext.emplace_back(surface_extra);
+                if (base_texture->gltexture) {
+                    extra.s_0 = s_half[0];
+                    extra.t_0 = t_half[0];
+                    extra.s_1 = s_half[k - 1];
+                    extra.t_1 = t_half[k - 1];
+                    extra.s_2 = s_half[k];
+                    extra.t_2 = t_half[k];
                 }
-                if (surf->flags & SURF_DRAWSKY)
-                    flags = MAT_FLAGS_SKY;
-                // max textures is 4096 (12 bit) and we have 16. so we can put 4 bits
-                // worth of flags here:
-                extra.texnum_fb_flags |= flags << 12;
-
-                ext.push_back(extra);
             }
             // p = p->next;
             p = 0; // XXX
@@ -468,6 +545,61 @@ void add_geo_brush(entity_t* ent,
     }
 }
 
+void add_geo_brush(entity_t* ent,
+                   qmodel_t* m,
+                   std::vector<float>& vtx,
+                   std::vector<float>& prev_vtx,
+                   std::vector<uint32_t>& idx,
+                   std::vector<VertexExtraData>& ext) {
+    glm::mat4 mat_model;
+    glm::mat4 mat_prev_model;
+    setup_brush_transforms(ent, mat_model, mat_prev_model);
+
+    const GeometryOutput out{vtx, prev_vtx, idx, ext};
+    add_geo_brush_surfaces(m, mat_model, mat_prev_model, ent->frame, 0, m->nummodelsurfaces, out,
+                           out);
+}
+
+uint32_t weld_vertices(std::vector<float>& vtx,
+                       std::vector<uint32_t>& idx,
+                       const float quantization) {
+    struct Cell {
+        int32_t x, y, z;
+        bool operator==(const Cell& other) const = default;
+    };
+    struct CellHash {
+        std::size_t operator()(const Cell& c) const {
+            return (std::size_t)c.x * 73856093 ^ (std::size_t)c.y * 19349663 ^
+                   (std::size_t)c.z * 83492791;
+        }
+    };
+
+    const uint32_t vertex_count = vtx.size() / 3;
+    std::unordered_map<Cell, uint32_t, CellHash> welded;
+    welded.reserve(vertex_count);
+    std::vector<uint32_t> remap(vertex_count);
+
+    uint32_t welded_count = 0;
+    for (uint32_t v = 0; v < vertex_count; v++) {
+        const Cell cell{(int32_t)std::lround(vtx[3 * v] * quantization),
+                        (int32_t)std::lround(vtx[3 * v + 1] * quantization),
+                        (int32_t)std::lround(vtx[3 * v + 2] * quantization)};
+        const auto [it, inserted] = welded.try_emplace(cell, welded_count);
+        if (inserted) {
+            // in place, welded_count <= v
+            std::copy_n(vtx.begin() + 3 * v, 3, vtx.begin() + 3 * welded_count);
+            welded_count++;
+        }
+        remap[v] = it->second;
+    }
+
+    vtx.resize(3 * welded_count);
+    for (uint32_t& i : idx)
+        i = remap[i];
+
+    return vertex_count - welded_count;
+}
+
 void add_geo_sprite(entity_t* ent,
                     [[maybe_unused]] qmodel_t* m,
                     std::vector<float>& vtx,
@@ -545,9 +677,15 @@ void add_geo_sprite(entity_t* ent,
     s_up = glm::normalize(s_up);
     s_right = glm::normalize(s_right);
 
+    // the corners of both quads in model space
+    std::array<glm::vec3, 8> corners;
+
     // add two quads
     for (int k = 0; k < 2; k++) {
-        glm::vec3 v0, v1, v2, v3;
+        glm::vec3& v0 = corners[4 * k + 0];
+        glm::vec3& v1 = corners[4 * k + 1];
+        glm::vec3& v2 = corners[4 * k + 2];
+        glm::vec3& v3 = corners[4 * k + 3];
 
         // clang-format off
         switch (k) {
@@ -570,26 +708,8 @@ void add_geo_sprite(entity_t* ent,
         }
         // clang-format on
 
-        // add vertices - triangle fan
-        uint32_t vtx_cnt = vtx.size() / 3;
-        for (int l = 0; l < 3; l++) {
-            vtx.emplace_back(v0[l] + ent->origin[l]);
-            prev_vtx.emplace_back(v0[l] + ent->mv_prev_origin[l]);
-        }
-        for (int l = 0; l < 3; l++) {
-            vtx.emplace_back(v1[l] + ent->origin[l]);
-            prev_vtx.emplace_back(v1[l] + ent->mv_prev_origin[l]);
-        }
-        for (int l = 0; l < 3; l++) {
-            vtx.emplace_back(v2[l] + ent->origin[l]);
-            prev_vtx.emplace_back(v2[l] + ent->mv_prev_origin[l]);
-        }
-        for (int l = 0; l < 3; l++) {
-            vtx.emplace_back(v3[l] + ent->origin[l]);
-            prev_vtx.emplace_back(v3[l] + ent->mv_prev_origin[l]);
-        }
-
         // add index - tiangle fan
+        const uint32_t vtx_cnt = vtx.size() / 3 + 4 * k;
         idx.emplace_back(vtx_cnt + 0);
         idx.emplace_back(vtx_cnt + 1);
         idx.emplace_back(vtx_cnt + 2);
@@ -608,29 +728,112 @@ void add_geo_sprite(entity_t* ent,
         // clang-format off
         ext.emplace_back(texnum,
                          MAT_FLAGS_SPRITE << 12, // sprite allways emits
-                         n_enc, n_enc, n_enc,
                          merian::float_to_half(0),            merian::float_to_half(frame->tmax),
                          merian::float_to_half(0),            merian::float_to_half(0),
-                         merian::float_to_half(frame->smax),  merian::float_to_half(0));
+                         merian::float_to_half(frame->smax),  merian::float_to_half(0),
+                         n_enc, n_enc, n_enc);
         ext.emplace_back(texnum,
                          MAT_FLAGS_SPRITE << 12, // sprite allways emits
-                         n_enc, n_enc, n_enc,
                          merian::float_to_half(0),            merian::float_to_half(frame->tmax),
                          merian::float_to_half(frame->smax),  merian::float_to_half(0),
-                         merian::float_to_half(frame->smax),  merian::float_to_half(frame->tmax));
+                         merian::float_to_half(frame->smax),  merian::float_to_half(frame->tmax),
+                         n_enc, n_enc, n_enc);
         // clang-format on
 
     } // end three axes
 
+    // add vertices - translate to the current and previous origin
+    const uint32_t vtx_cnt = vtx.size() / 3;
+    vtx.resize(vtx.size() + 3 * corners.size());
+    prev_vtx.resize(prev_vtx.size() + 3 * corners.size());
+    const glm::mat4 mat_model =
+        glm::translate(glm::identity<glm::mat4>(), *merian::as_vec3(ent->origin));
+    const glm::mat4 mat_prev_model =
+        glm::translate(glm::identity<glm::mat4>(), *merian::as_vec3(ent->mv_prev_origin));
+    transform_positions_2(&corners[0].x, 3, corners.size(), mat_model, mat_prev_model,
+                          vtx.data() + 3 * vtx_cnt, prev_vtx.data() + 3 * vtx_cnt);
+
     VectorCopy(ent->origin, ent->mv_prev_origin);
 }
 
 // Adds the geo from entity into the vectors.
+bool entity_geometry_key(entity_t* ent,
+                         ResolvedAliasModel* resolved_alias,
+                         EntityGeometryKey& key) {
+    qmodel_t* m = ent->model;
+    if (!m || ent == &cl.viewent)
+        return false;
+
+    key = {};
+    key.model = m;
+    key.frame = ent->frame;
+
+    if (m->type == mod_alias) {
+        if (!resolved_alias || !resolved_alias->hdr)
+            return false;
+        aliashdr_t* hdr = resolved_alias->hdr;
+        if (ent->frame < 0 || ent->frame >= hdr->numposes)
+            return false;
+
+        setup_alias_transforms(ent, *resolved_alias);
+        const lerpdata_t& lerpdata = resolved_alias->lerpdata;
+        key.origin = *merian::as_vec3(lerpdata.origin);
+        key.angles = *merian::as_vec3(lerpdata.angles);
+        key.pose1 = lerpdata.pose1;
+        key.pose2 = lerpdata.pose2;
+        key.blend = lerpdata.blend;
+
+        // see add_geo_alias
+        const int sk = glm::clamp(ent->skinnum, 0, hdr->numskins - 1),
+                  fm = ((int)(cl.time * 10)) & 3;
+        key.skin_textures[0] = hdr->gltextures[sk][fm];
+        key.skin_textures[1] = hdr->fbtextures[sk][fm];
+        key.skin_textures[2] = hdr->gstextures[sk][fm];
+        key.skin_textures[3] = hdr->nmtextures[sk][fm];
+        return true;
+    }
+    if (m->type == mod_brush) {
+        if (brush_model_has_animated_textures(m))
+            return false;
+        key.origin = *merian::as_vec3(ent->origin);
+        key.angles = *merian::as_vec3(ent->angles);
+        return true;
+    }
+
+    // sprites face the camera
+    return false;
+}
+
+uint32_t estimate_entity_cost(entity_t* ent, const ResolvedAliasModel* resolved_alias) {
+    qmodel_t* m = ent->model;
+    if (!m)
+        return 0;
+
+    if (m->type == mod_alias) {
+        if (!resolved_alias || !resolved_alias->cache)
+            return 0;
+        return resolved_alias->cache->numverts_vbo + resolved_alias->cache->numindexes / 3;
+    }
+    if (m->type == mod_brush) {
+        uint32_t cost = 0;
+        for (int i = 0; i < m->nummodelsurfaces; i++) {
+            const msurface_t* surf = &m->surfaces[m->firstmodelsurface + i];
+            // a fan of numedges vertices and numedges - 2 triangles
+            cost += 2 * std::max(surf->numedges - 1, 0);
+        }
+        return cost;
+    }
+
+    // sprites are a single quad
+    return 6;
+}
+
 void add_geo(entity_t* ent,
              std::vector<float>& vtx,
              std::vector<float>& prev_vtx,
              std::vector<uint32_t>& idx,
-             std::vector<VertexExtraData>& ext) {
+             std::vector<VertexExtraData>& ext,
+             ResolvedAliasModel* resolved_alias) {
     if (!ent)
         return;
     qmodel_t* m = ent->model;
@@ -638,7 +841,10 @@ void add_geo(entity_t* ent,
         return;
 
     if (m->type == mod_alias) { // alias model:
-        add_geo_alias(ent, m, vtx, prev_vtx, idx, ext);
+        if (resolved_alias && resolved_alias->hdr)
+            add_geo_alias(ent, *resolved_alias, vtx, prev_vtx, idx, ext);
+        else
+            add_geo_alias(ent, m, vtx, prev_vtx, idx, ext);
     } else if (m->type == mod_brush) { // brush model:
         add_geo_brush(ent, m, vtx, prev_vtx, idx, ext);
     } else if (m->type == mod_sprite) {
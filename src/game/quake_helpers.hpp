@@ -1,6 +1,9 @@
 #pragma once
 
+#include "game/alias_pose_cache.hpp"
+
 #include <glm/glm.hpp>
+#include <mutex>
 #include <vector>
 
 extern "C" {
@@ -8,6 +11,9 @@ extern "C" {
 }
 
 struct VertexExtraData {
+    // The first 16 bytes are read for every candidate hit while tracing (alpha test), the normals
+    // only for the closest hit.
+
     // texnum and alpha in upper 4 bits
     // Alpha meaning: 0: use texture, [1,15] map to [0,1] where 15 is fully opaque and 1
     // transparent
@@ -16,14 +22,6 @@ struct VertexExtraData {
     // for flags see MAT_FLAGS_* in config.h
     uint16_t texnum_fb_flags{};
 
-    // Normals encoded using encode_normal
-    // or glossmap texnum and normalmap texnum
-    // if n1_brush = ~0.
-    uint32_t n0_gloss_norm{};
-    // Marks as brush model if ~0, else second normal
-    uint32_t n1_brush{};
-    uint32_t n2{};
-
     // Texture coords, encoded using float_to_half
     uint16_t s_0{};
     uint16_t t_0{};
@@ -31,35 +29,202 @@ struct VertexExtraData {
     uint16_t t_1{};
     uint16_t s_2{};
     uint16_t t_2{};
+
+    // Normals encoded using encode_normal
+    // or glossmap texnum and normalmap texnum
+    // if n1_brush = ~0.
+    uint32_t n0_gloss_norm{};
+    // Marks as brush model if ~0, else second normal
+    uint32_t n1_brush{};
+    uint32_t n2{};
 };
+static_assert(sizeof(VertexExtraData) == 28);
 
 uint16_t
 make_texnum_alpha(gltexture_s* tex, entity_t* entity = nullptr, msurface_t* surface = nullptr);
 
-void add_particles(std::vector<float>& vtx,
+// Per-texture part of the brush materials, computed once when the texture is loaded instead of
+// for every primitive in add_geo_brush.
+struct TextureMaterial {
+    // the texture this material was computed for, to detect reused texnums
+    const gltexture_s* texture = nullptr;
+    // see make_texnum_alpha
+    uint16_t texnum_alpha = 0;
+    // hack for ad_tears and emissive waterfalls, tested on the full gltexture name
+    bool waterfall = false;
+};
+
+// Computes the material of tex. Must be called when tex is (re-)loaded and not concurrently to the
+// geometry extraction.
+void update_texture_material(gltexture_s* tex);
+
+// Returns the material of tex, falls back to computing it if tex was not loaded through
+// update_texture_material.
+TextureMaterial get_texture_material(gltexture_s* tex);
+
+// Size of a particle as in r_part.c.
+float particle_scale(const particle_t* p, const vec3_t r_origin, const vec3_t vpn);
+
+// Seed for the random shape of a particle, stable over frames if no_random is set.
+uint32_t particle_seed(const particle_t* p, const bool no_random);
+
+// Heuristics to improve blood, fire and explosions. Selects the texture (0 for solid colored
+// particles) and the fullbright texture and adjusts the scale. color is from d_8to24table.
+void classify_particle(const particle_t* p,
+                       const uint32_t color,
+                       const uint32_t texnum_blood,
+                       const uint32_t texnum_explosion,
+                       uint32_t& texnum,
+                       uint32_t& texnum_fb,
+                       float& scale);
+
+// Number of active particles.
+uint32_t count_particles();
+
+// Probability to keep a particle such that about budget particles are kept. A budget of 0 means no
+// limit.
+float particle_keep_probability(const uint32_t particle_count, const uint32_t budget);
+
+// Stochastic thinning: Decides per particle, using its seed, if it is kept. The decision is stable
+// over frames and deterministic if no_random is set.
+bool keep_particle(const particle_t* p, const bool no_random, const float keep_probability);
+
+// Adds the active particles that are kept with keep_probability. The size of the kept particles is
+// scaled by 1 / sqrt(keep_probability) to preserve the covered area and emitted energy. Returns the
+// number of kept particles.
+uint32_t add_particles(std::vector<float>& vtx,
+                       std::vector<float>& prev_vtx,
+                       std::vector<uint32_t>& idx,
+                       std::vector<VertexExtraData>& ext,
+                       const uint32_t texnum_blood,
+                       const uint32_t texnum_explosion,
+                       const bool no_random,
+                       const double prev_cl_time,
+                       const float keep_probability = 1.f);
+
+// Guards Mod_Extradata and the use of the returned header.
+extern std::mutex alias_hdr_mutex;
+
+// Sets up the lerpdata for the current frame and computes the current and previous model matrices
+// of an alias entity. hdr must be the header of ent->model.
+void setup_alias_transforms(entity_t* ent,
+                            aliashdr_t* hdr,
+                            lerpdata_t& lerpdata,
+                            glm::mat4& mat_model,
+                            glm::mat4& mat_prev_model);
+
+// The header and pose cache of an alias model.
+//
+// Mod_Extradata can move the headers of other models when a model is loaded into the cache. As
+// long as no header is resolved concurrently, resolved headers can be used without locking.
+struct ResolvedAliasModel {
+    aliashdr_t* hdr = nullptr;
+    const AliasPoseCache* cache = nullptr;
+
+    // The lerp state and model matrices of the entity for the current frame, set up once by
+    // setup_alias_transforms such that the cache key and the extraction share them.
+    bool has_transforms = false;
+    lerpdata_t lerpdata;
+    glm::mat4 mat_model;
+    glm::mat4 mat_prev_model;
+};
+
+// Resolves the header of ent->model under alias_hdr_mutex and builds its pose cache if needed.
+// Returns false if ent is not an alias entity.
+bool resolve_alias_model(entity_t* ent, ResolvedAliasModel& resolved);
+
+// Sets up the transforms of resolved for ent, if this was not done since it was resolved.
+void setup_alias_transforms(entity_t* ent, ResolvedAliasModel& resolved);
+
+// The inputs the geometry of an entity is generated from, see entity_geometry_key.
+struct EntityGeometryKey {
+    qmodel_t* model = nullptr;
+    // for alias models after lerping
+    glm::vec3 origin{};
+    glm::vec3 angles{};
+    int frame = 0;
+    // alias models only
+    int pose1 = 0;
+    int pose2 = 0;
+    float blend = 0;
+    gltexture_s* skin_textures[4] = {};
+
+    bool operator==(const EntityGeometryKey& other) const = default;
+};
+
+// Computes the key of ent. If two keys are equal add_geo generates the same vertices, indices and
+// extra data and the previous vertices equal the vertices. Returns false if the geometry depends on
+// further state (sprites, animated textures, the view model) and must be regenerated every frame.
+// For alias models this sets up the transforms of resolved_alias, which add_geo reuses.
+bool entity_geometry_key(entity_t* ent,
+                         ResolvedAliasModel* resolved_alias,
+                         EntityGeometryKey& key);
+
+// Estimates the extraction cost of ent as number of vertices and primitives add_geo generates.
+uint32_t estimate_entity_cost(entity_t* ent, const ResolvedAliasModel* resolved_alias);
+
+// Resolves the model and adds it while holding alias_hdr_mutex.
+void add_geo_alias(entity_t* ent,
+                   [[maybe_unused]] qmodel_t* m,
+                   std::vector<float>& vtx,
                    std::vector<float>& prev_vtx,
                    std::vector<uint32_t>& idx,
-                   std::vector<VertexExtraData>& ext,
-                   const uint32_t texnum_blood,
-                   const uint32_t texnum_explosion,
-                   const bool no_random,
-                   const double prev_cl_time);
+                   std::vector<VertexExtraData>& ext);
 
+// Lock-free, see ResolvedAliasModel.
 void add_geo_alias(entity_t* ent,
-                   [[maybe_unused]] qmodel_t* m,
+                   ResolvedAliasModel& resolved,
                    std::vector<float>& vtx,
                    std::vector<float>& prev_vtx,
                    std::vector<uint32_t>& idx,
                    std::vector<VertexExtraData>& ext);
 
-// geo_selector: 0 -> all, 1 -> opaque, 2 -> transparent
+// Computes the current and previous model matrices of a brush entity and advances its motion
+// vector state.
+void setup_brush_transforms(entity_t* ent, glm::mat4& mat_model, glm::mat4& mat_prev_model);
+
+// Merges vertices whose positions fall into the same cell of a grid with 1 / quantization spacing
+// and remaps idx. The merged vertex keeps the position of the first vertex of the cell. Only valid
+// if all other per-vertex data is per primitive (as in VertexExtraData). Returns the number of
+// removed vertices.
+uint32_t weld_vertices(std::vector<float>& vtx,
+                       std::vector<uint32_t>& idx,
+                       const float quantization);
+
+// Returns true if a texture of the brush model animates over time or with the entity frame.
+bool brush_model_has_animated_textures(qmodel_t* m);
+
+// Returns true if the geometry of a static entity changes over time (frame groups, skin groups,
+// animated textures, sprites).
+bool static_entity_animates(entity_t* ent);
+
+// The output vectors of a geometry.
+struct GeometryOutput {
+    std::vector<float>& vtx;
+    std::vector<float>& prev_vtx;
+    std::vector<uint32_t>& idx;
+    std::vector<VertexExtraData>& ext;
+};
+
+// Triangulates the surfaces [surface_begin, surface_end) of the brush model m with the supplied
+// transforms and texture animation frame. Opaque surfaces are added to opaque, surfaces with alpha
+// tested textures to alpha (which may be the same output). Does not change any state and can run
+// concurrently for different outputs.
+void add_geo_brush_surfaces(qmodel_t* m,
+                            const glm::mat4& mat_model,
+                            const glm::mat4& mat_prev_model,
+                            const int frame,
+                            const int surface_begin,
+                            const int surface_end,
+                            const GeometryOutput& opaque,
+                            const GeometryOutput& alpha);
+
 void add_geo_brush(entity_t* ent,
                    qmodel_t* m,
                    std::vector<float>& vtx,
                    std::vector<float>& prev_vtx,
                    std::vector<uint32_t>& idx,
-                   std::vector<VertexExtraData>& ext,
-                   int geo_selector = 0);
+                   std::vector<VertexExtraData>& ext);
 
 void add_geo_sprite(entity_t* ent,
                     [[maybe_unused]] qmodel_t* m,
@@ -69,8 +234,10 @@ void add_geo_sprite(entity_t* ent,
                     std::vector<VertexExtraData>& ext);
 
 // Adds the geo from entity into the vectors.
+// If resolved_alias is set alias models are added without locking.
 void add_geo(entity_t* ent,
              std::vector<float>& vtx,
              std::vector<float>& prev_vtx,
              std::vector<uint32_t>& idx,
-             std::vector<VertexExtraData>& ext);
+             std::vector<VertexExtraData>& ext,
+             ResolvedAliasModel* resolved_alias = nullptr);
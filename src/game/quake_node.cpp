@@ -1,13 +1,25 @@
 #include "quake_node.hpp"
 
+#include "game/alias_pose_cache.hpp"
 #include "game/quake_helpers.hpp"
+#include "game/vertex_transform.hpp"
 #include "merian/utils/audio/sdl_audio_device.hpp"
 #include "merian/utils/colors.hpp"
 #include "merian/utils/concurrent/utils.hpp"
 #include "merian/utils/glm.hpp"
+#include "merian/vk/descriptors/descriptor_set_layout_builder.hpp"
 #include "merian/vk/extension/extension_vk_ray_tracing_position_fetch.hpp"
+#include "merian/vk/pipeline/pipeline_compute.hpp"
+#include "merian/vk/pipeline/pipeline_layout_builder.hpp"
+#include "merian/vk/pipeline/specialization_info_builder.hpp"
+#include "merian/vk/shader/shader_module.hpp"
 
 #include <GLFW/glfw3.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <numeric>
+#include <thread>
 
 extern "C" {
 #include "bgmusic.h"
@@ -313,7 +325,8 @@ void parse_worldspawn() {
 }
 
 // If the supplied buffer is not nullptr and is large enough, it is returned and an upload is
-// recorded. A new larger buffer is used otherwise.
+// recorded. A new larger buffer is used otherwise. The buffer holds at least reserve_count
+// elements, elements after data are not written.
 template <typename T>
 merian::BufferHandle ensure_buffer(const merian::ResourceAllocatorHandle& allocator,
                                    const vk::BufferUsageFlags usage,
@@ -321,9 +334,11 @@ merian::BufferHandle ensure_buffer(const merian::ResourceAllocatorHandle& alloca
                                    const std::vector<T>& data,
                                    const merian::BufferHandle& optional_buffer,
                                    const std::optional<vk::DeviceSize> min_alignment = std::nullopt,
-                                   const std::string& debug_name = {}) {
+                                   const std::string& debug_name = {},
+                                   const std::size_t reserve_count = 0) {
     merian::BufferHandle buffer = optional_buffer;
-    if (!allocator->ensureBufferSize(buffer, merian::size_of(data), usage, debug_name,
+    const vk::DeviceSize size = std::max(merian::size_of(data), reserve_count * sizeof(T));
+    if (!allocator->ensureBufferSize(buffer, size, usage, debug_name,
                                      merian::MemoryMappingType::NONE, min_alignment, 1.25)) {
         cmd->barrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR |
                          vk::PipelineStageFlagBits::eComputeShader,
@@ -333,42 +348,53 @@ merian::BufferHandle ensure_buffer(const merian::ResourceAllocatorHandle& alloca
                                                 vk::AccessFlagBits::eTransferRead,
                                             vk::AccessFlagBits::eTransferWrite));
     }
-    allocator->getStaging()->cmd_to_device(cmd, buffer, data);
+    if (!data.empty())
+        allocator->getStaging()->cmd_to_device(cmd, buffer, data);
     return buffer;
 }
 
 // Creates a vertex and index buffer for rt on the device and records the upload.
 // If the supplied buffers are not nullptr and are large enough, they are returned and an upload
 // is recorded. Returns (vertex_buffer, index_buffer).
-// Appropriate barriers are inserted.
+// If prev_vtx is nullptr the geometry is static and the vertex buffer is returned as previous
+// vertex buffer as well.
+// Space for at least reserve_vertex_count vertices and reserve_primitive_count primitives is
+// allocated. Appropriate barriers are inserted.
 static std::
     tuple<merian::BufferHandle, merian::BufferHandle, merian::BufferHandle, merian::BufferHandle>
     ensure_vertex_index_ext_buffer(const merian::ResourceAllocatorHandle& allocator,
                                    const merian::CommandBufferHandle& cmd,
                                    const std::vector<float>& vtx,
-                                   const std::vector<float>& prev_vtx,
+                                   const std::vector<float>* prev_vtx,
                                    const std::vector<uint32_t>& idx,
                                    const std::vector<VertexExtraData>& ext,
                                    const merian::BufferHandle& optional_vtx_buffer,
                                    const merian::BufferHandle& optional_prev_vtx_buffer,
                                    const merian::BufferHandle& optional_idx_buffer,
-                                   const merian::BufferHandle& optional_ext_buffer) {
+                                   const merian::BufferHandle& optional_ext_buffer,
+                                   const uint32_t reserve_vertex_count = 0,
+                                   const uint32_t reserve_primitive_count = 0) {
     auto usage_rt = vk::BufferUsageFlagBits::eShaderDeviceAddress |
                     vk::BufferUsageFlagBits::eStorageBuffer |
                     vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR;
     auto usage_storage = vk::BufferUsageFlagBits::eStorageBuffer;
 
-    merian::BufferHandle vertex_buffer = ensure_buffer(
-        allocator, usage_rt, cmd, vtx, optional_vtx_buffer, {}, "Quake: vertex buffer");
+    merian::BufferHandle vertex_buffer =
+        ensure_buffer(allocator, usage_rt, cmd, vtx, optional_vtx_buffer, {},
+                      "Quake: vertex buffer", 3 * reserve_vertex_count);
     merian::BufferHandle prev_vertex_buffer =
-        ensure_buffer(allocator, usage_rt, cmd, prev_vtx, optional_prev_vtx_buffer, {},
-                      "Quake: previous vertex buffer");
-    merian::BufferHandle index_buffer = ensure_buffer(
-        allocator, usage_rt, cmd, idx, optional_idx_buffer, {}, "Quake: index buffer");
-    merian::BufferHandle ext_buffer = ensure_buffer(allocator, usage_storage, cmd, ext,
-                                                    optional_ext_buffer, {}, "Quake: ext buffer");
-
-    const std::array<vk::BufferMemoryBarrier2, 4> barriers = {
+        prev_vtx != nullptr
+            ? ensure_buffer(allocator, usage_rt, cmd, *prev_vtx, optional_prev_vtx_buffer, {},
+                            "Quake: previous vertex buffer", 3 * reserve_vertex_count)
+            : vertex_buffer;
+    merian::BufferHandle index_buffer =
+        ensure_buffer(allocator, usage_rt, cmd, idx, optional_idx_buffer, {},
+                      "Quake: index buffer", 3 * reserve_primitive_count);
+    merian::BufferHandle ext_buffer =
+        ensure_buffer(allocator, usage_storage, cmd, ext, optional_ext_buffer, {},
+                      "Quake: ext buffer", reserve_primitive_count);
+
+    std::vector<vk::BufferMemoryBarrier2> barriers = {
         vertex_buffer->buffer_barrier2(
             vk::PipelineStageFlagBits2::eTransfer,
             vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR |
@@ -376,11 +402,6 @@ static std::
             vk::AccessFlagBits2::eTransferWrite,
             vk::AccessFlagBits2::eAccelerationStructureReadKHR | vk::AccessFlagBits2::eShaderRead |
                 vk::AccessFlagBits2::eTransferWrite),
-        prev_vertex_buffer->buffer_barrier2(
-            vk::PipelineStageFlagBits2::eTransfer,
-            vk::PipelineStageFlagBits2::eComputeShader | vk::PipelineStageFlagBits2::eTransfer,
-            vk::AccessFlagBits2::eTransferWrite,
-            vk::AccessFlagBits2::eShaderRead | vk::AccessFlagBits2::eTransferWrite),
         index_buffer->buffer_barrier2(
             vk::PipelineStageFlagBits2::eTransfer,
             vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR |
@@ -394,12 +415,39 @@ static std::
             vk::AccessFlagBits2::eTransferWrite,
             vk::AccessFlagBits2::eShaderRead | vk::AccessFlagBits2::eTransferWrite),
     };
+    if (prev_vtx != nullptr) {
+        barriers.emplace_back(prev_vertex_buffer->buffer_barrier2(
+            vk::PipelineStageFlagBits2::eTransfer,
+            vk::PipelineStageFlagBits2::eComputeShader | vk::PipelineStageFlagBits2::eTransfer,
+            vk::AccessFlagBits2::eTransferWrite,
+            vk::AccessFlagBits2::eShaderRead | vk::AccessFlagBits2::eTransferWrite));
+    }
 
     cmd->barrier(barriers);
 
     return std::make_tuple(vertex_buffer, prev_vertex_buffer, index_buffer, ext_buffer);
 }
 
+// Points the BLAS of geo to its buffers, the BLAS of old_geo is reused if it exists.
+static void set_rt_geometry_blas(QuakeNode::RTGeometry& geo,
+                                 const QuakeNode::RTGeometry& old_geo,
+                                 const vk::BuildAccelerationStructureFlagsKHR flags,
+                                 const uint32_t vertex_count,
+                                 const uint32_t primitive_count) {
+    if (old_geo.blas_info) {
+        geo.blas_info = old_geo.blas_info;
+        geo.geo_handle = old_geo.geo_handle;
+        geo.blas_info->update_geometry_f32_u32(geo.geo_handle, vertex_count, primitive_count,
+                                               geo.vtx, geo.idx);
+    } else {
+        geo.blas_info = std::make_shared<merian_nodes::DeviceASBuilder::BlasBuildInfo>(flags);
+        geo.geo_handle =
+            geo.blas_info->add_geometry_f32_u32(vertex_count, primitive_count, geo.vtx, geo.idx);
+    }
+}
+
+// The geometry holds at least reserve_vertex_count vertices and reserve_primitive_count primitives,
+// which allows to write vertices and primitives after the supplied data on the device.
 static QuakeNode::RTGeometry get_rt_geometry(const merian::ResourceAllocatorHandle& allocator,
                                              const merian::CommandBufferHandle& cmd,
                                              const std::vector<float>& vtx,
@@ -407,47 +455,135 @@ static QuakeNode::RTGeometry get_rt_geometry(const merian::ResourceAllocatorHand
                                              const std::vector<uint32_t>& idx,
                                              const std::vector<VertexExtraData>& ext,
                                              const QuakeNode::RTGeometry& old_geo,
-                                             const vk::BuildAccelerationStructureFlagsKHR flags) {
-    assert(!vtx.empty());
-    assert(!prev_vtx.empty());
-    assert(!idx.empty());
-    assert(!ext.empty());
+                                             const vk::BuildAccelerationStructureFlagsKHR flags,
+                                             const uint32_t reserve_vertex_count = 0,
+                                             const uint32_t reserve_primitive_count = 0) {
+    assert(vtx.size() == prev_vtx.size());
+    assert(ext.size() == idx.size() / 3);
+
+    QuakeNode::RTGeometry geo;
+
+    const uint32_t vertex_count = std::max((uint32_t)vtx.size() / 3, reserve_vertex_count);
+    const uint32_t primitive_count = std::max((uint32_t)idx.size() / 3, reserve_primitive_count);
+    assert(vertex_count > 0);
+    assert(primitive_count > 0);
+
+    std::tie(geo.vtx, geo.prev_vtx, geo.idx, geo.ext) = ensure_vertex_index_ext_buffer(
+        allocator, cmd, vtx, &prev_vtx, idx, ext, old_geo.vtx, old_geo.prev_vtx, old_geo.idx,
+        old_geo.ext, vertex_count, primitive_count);
+    set_rt_geometry_blas(geo, old_geo, flags, vertex_count, primitive_count);
+
+    return geo;
+}
+
+// Like get_rt_geometry for geometry that does not move, prev_vtx of the result is the vertex
+// buffer. The vertices are uploaded and stored only once.
+static QuakeNode::RTGeometry
+get_static_rt_geometry(const merian::ResourceAllocatorHandle& allocator,
+                       const merian::CommandBufferHandle& cmd,
+                       const std::vector<float>& vtx,
+                       const std::vector<uint32_t>& idx,
+                       const std::vector<VertexExtraData>& ext,
+                       const QuakeNode::RTGeometry& old_geo,
+                       const vk::BuildAccelerationStructureFlagsKHR flags) {
+    assert(ext.size() == idx.size() / 3);
 
     QuakeNode::RTGeometry geo;
 
     const uint32_t vertex_count = vtx.size() / 3;
     const uint32_t primitive_count = idx.size() / 3;
+    assert(vertex_count > 0);
+    assert(primitive_count > 0);
 
+    // a separate previous vertex buffer of old_geo is dropped.
     std::tie(geo.vtx, geo.prev_vtx, geo.idx, geo.ext) =
-        ensure_vertex_index_ext_buffer(allocator, cmd, vtx, prev_vtx, idx, ext, old_geo.prev_vtx,
-                                       old_geo.vtx, old_geo.idx, old_geo.ext);
+        ensure_vertex_index_ext_buffer(allocator, cmd, vtx, nullptr, idx, ext, old_geo.vtx,
+                                       nullptr, old_geo.idx, old_geo.ext);
+    set_rt_geometry_blas(geo, old_geo, flags, vertex_count, primitive_count);
 
-    if (old_geo.blas_info) {
-        geo.blas_info = old_geo.blas_info;
-        geo.geo_handle = old_geo.geo_handle;
-        geo.blas_info->update_geometry_f32_u32(geo.geo_handle, vertex_count, primitive_count,
-                                               geo.vtx, geo.idx);
-    } else {
-        geo.blas_info = std::make_shared<merian_nodes::DeviceASBuilder::BlasBuildInfo>(flags);
-        geo.geo_handle =
-            geo.blas_info->add_geometry_f32_u32(vertex_count, primitive_count, geo.vtx, geo.idx);
-    }
+    return geo;
+}
+
+// Returns a host visible, persistently mapped buffer with at least count elements.
+template <typename T>
+static T* ensure_mapped_buffer(const merian::ResourceAllocatorHandle& allocator,
+                               const vk::BufferUsageFlags usage,
+                               merian::BufferHandle& buffer,
+                               const std::size_t count,
+                               const std::string& debug_name) {
+    allocator->ensureBufferSize(buffer, count * sizeof(T), usage, debug_name,
+                                merian::MemoryMappingType::HOST_ACCESS_SEQUENTIAL_WRITE,
+                                std::nullopt, 1.25);
+    return buffer->get_memory()->map_as<T>();
+}
+
+// Like get_rt_geometry but the buffers are not uploaded, the caller writes vertex_count vertices
+// and primitive_count primitives to the mapped buffers before the command buffer is submitted.
+// If motion_delta is set, prev_vtx has space for the motion deltas only (4 halfs per vertex).
+static QuakeNode::RTGeometry
+get_mapped_rt_geometry(const merian::ResourceAllocatorHandle& allocator,
+                       QuakeNode::MappedGeometryBuffers& buffers,
+                       const QuakeNode::RTGeometry& old_geo,
+                       const vk::BuildAccelerationStructureFlagsKHR flags,
+                       const uint32_t vertex_count,
+                       const uint32_t primitive_count,
+                       const bool motion_delta,
+                       float*& vtx,
+                       float*& prev_vtx,
+                       uint32_t*& idx,
+                       VertexExtraData*& ext) {
+    assert(vertex_count > 0);
+    assert(primitive_count > 0);
+
+    const auto usage_rt = vk::BufferUsageFlagBits::eShaderDeviceAddress |
+                          vk::BufferUsageFlagBits::eStorageBuffer |
+                          vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR;
+    vtx = ensure_mapped_buffer<float>(allocator, usage_rt, buffers.vtx, 3 * vertex_count,
+                                      "Quake: mapped vertex buffer");
+    prev_vtx = ensure_mapped_buffer<float>(allocator, usage_rt, buffers.prev_vtx,
+                                           (motion_delta ? 2 : 3) * vertex_count,
+                                           "Quake: mapped previous vertex buffer");
+    idx = ensure_mapped_buffer<uint32_t>(allocator, usage_rt, buffers.idx, 3 * primitive_count,
+                                         "Quake: mapped index buffer");
+    ext = ensure_mapped_buffer<VertexExtraData>(allocator, vk::BufferUsageFlagBits::eStorageBuffer,
+                                                buffers.ext, primitive_count,
+                                                "Quake: mapped ext buffer");
+
+    QuakeNode::RTGeometry geo;
+    geo.vtx = buffers.vtx;
+    geo.prev_vtx = buffers.prev_vtx;
+    geo.idx = buffers.idx;
+    geo.ext = buffers.ext;
+    geo.motion_delta = motion_delta;
+    // host writes are visible to the device on submit
+    geo.write_access = vk::AccessFlagBits2::eHostWrite;
+    geo.write_stage = vk::PipelineStageFlagBits2::eHost;
+    set_rt_geometry_blas(geo, old_geo, flags, vertex_count, primitive_count);
 
     return geo;
 }
 
+static void unmap_geometry_buffers(const QuakeNode::RTGeometry& geo) {
+    geo.vtx->get_memory()->unmap();
+    geo.prev_vtx->get_memory()->unmap();
+    geo.idx->get_memory()->unmap();
+    geo.ext->get_memory()->unmap();
+}
+
+static vk::TransformMatrixKHR to_transform_matrix(const glm::mat4& mat) {
+    vk::TransformMatrixKHR transform;
+    for (int r = 0; r < 3; r++)
+        for (int c = 0; c < 4; c++)
+            transform.matrix[r][c] = mat[c][r];
+    return transform;
+}
+
 QuakeNode::QuakeNode([[maybe_unused]] const merian::ContextHandle& context,
                      const merian::ResourceAllocatorHandle& allocator,
                      const int quakespasm_argc,
                      const char** quakespasm_argv)
     : Node(), context(context), allocator(allocator) {
 
-    // reserve roughly 1GB for all vectors
-    vtx.reserve(256 * 1024 * 1024 / sizeof(float));
-    prev_vtx.reserve(256 * 1024 * 1024 / sizeof(float));
-    idx.reserve(256 * 1024 * 1024 / sizeof(uint32_t));
-    ext.reserve(256 * 1024 * 1024 / sizeof(VertexExtraData));
-
     // INIT QUAKE
     if (quake_data.quake_node != nullptr) {
         throw std::runtime_error{"Only one quake node can be created."};
@@ -463,21 +599,17 @@ QuakeNode::QuakeNode([[maybe_unused]] const merian::ContextHandle& context,
         // RUN GAMELOOP
         while (game_running) {
 
-            if (!pending_commands.empty()) {
-                Cmd_ExecuteString(pending_commands.front().c_str(), src_command);
-                pending_commands.pop();
-            }
+            drain_input_events();
 
             try {
                 render_info.render = false;
                 Host_Frame(quake_data.timediff);
                 if (!render_info.render) {
                     // make sure we release the main thread
-                    sync_gamestate.push(true, 1);
                     if (!game_running) {
                         std::runtime_error{"quit"};
                     }
-                    quake_data.timediff = sync_render.pop();
+                    end_game_frame();
                 }
             } catch (const std::runtime_error&) {
                 // game quit, do nothing
@@ -503,10 +635,8 @@ QuakeNode::~QuakeNode() {
 void QuakeNode::QS_worldspawn() {
     SPDLOG_DEBUG("worldspawn");
 
-    parse_worldspawn();
-
-    last_worldspawn_frame = frame;
-    render_info.constant_data_update = true;
+    // The render thread might still use the alias pose caches, see process.
+    worldspawn_pending = true;
 }
 
 void QuakeNode::IN_Move(usercmd_t* cmd) {
@@ -544,13 +674,53 @@ void QuakeNode::IN_Move(usercmd_t* cmd) {
     }
 }
 
+void QuakeNode::late_latch_view_angles(vec3_t angles) const {
+    if (!raw_mouse_was_enabled || key_dest != key_game)
+        return;
+
+    // see IN_Move
+    const int dmx = (latest_mouse_x - mouse_oldx) * sensitivity.value;
+    const int dmy = (latest_mouse_y - mouse_oldy) * sensitivity.value;
+
+    if (!((in_strafe.state & 1) || (lookstrafe.value && (in_mlook.state & 1))))
+        angles[YAW] -= m_yaw.value * dmx;
+
+    if ((in_mlook.state & 1) && !(in_strafe.state & 1)) {
+        angles[PITCH] = std::clamp(angles[PITCH] + m_pitch.value * dmy, cl_minpitch.value,
+                                   cl_maxpitch.value);
+    }
+}
+
 void QuakeNode::R_RenderScene() {
     if (!game_running) {
         throw std::runtime_error{"quit"};
     }
     render_info.render = true;
+    end_game_frame();
+}
+
+void QuakeNode::end_game_frame() {
+    if (async_simulation && !render_requested) {
+        quake_data.timediff = wait_for_tick();
+        return;
+    }
+
     sync_gamestate.push(true, 1);
     quake_data.timediff = sync_render.pop();
+    if (async_simulation) {
+        // the time delta of the graph is not used, the time waiting for the render thread counts
+        quake_data.timediff = wait_for_tick();
+    }
+}
+
+float QuakeNode::wait_for_tick() {
+    const double tick = 1. / std::max(simulation_tick_rate, 1.f);
+    const double elapsed = tick_stopwatch.seconds();
+    if (elapsed < tick)
+        std::this_thread::sleep_for(std::chrono::duration<double>(tick - elapsed));
+    const float timediff = tick_stopwatch.seconds();
+    tick_stopwatch.reset();
+    return timediff;
 }
 
 void QuakeNode::VID_Changed_f([[maybe_unused]] cvar_t* var) {
@@ -583,6 +753,8 @@ void QuakeNode::QS_texture_load(gltexture_t* glt, uint32_t* data) {
     if (strcmp(glt->name, "progs/s_exp_big.spr:frame10") == 0)
         texnum_explosion = glt->texnum;
 
+    update_texture_material(glt);
+
     // ALLOCATE ----------------------------
 
     // We store the texture on system memory for now
@@ -631,43 +803,94 @@ void QuakeNode::set_controller(const merian::InputControllerHandle& controller)
         if (key >= 65 && key <= 90) key |= 32;
         else if (keymap.contains(key)) key = keymap.at(key);
 
-        if (action == merian::InputController::PRESS) {
-            Key_Event(key, true);
-        } else if (action == merian::InputController::RELEASE) {
-            Key_Event(key, false);
+        if (action == merian::InputController::PRESS || action == merian::InputController::RELEASE) {
+            InputEvent event;
+            event.type = InputEvent::KEY;
+            event.key = key;
+            event.down = action == merian::InputController::PRESS;
+            push_input_event(std::move(event));
         }
     });
     controller->set_mouse_cursor_callback([&](merian::InputController& controller, double xpos, double ypos){
         const bool raw = controller.get_raw_mouse_input();
 
-        if (raw) {
-            this->mouse_x = xpos;
-            this->mouse_y = ypos;
-        }
+        InputEvent event;
+        event.type = InputEvent::MOUSE_CURSOR;
+        event.x = xpos;
+        event.y = ypos;
+        event.reset = raw != raw_mouse_was_enabled || !raw;
+        push_input_event(std::move(event));
 
-        if (raw != raw_mouse_was_enabled || !raw) {
-            this->mouse_x = this->mouse_oldx = xpos;
-            this->mouse_y = this->mouse_oldy = ypos;
-        }
-   
+        latest_mouse_x = xpos;
+        latest_mouse_y = ypos;
         raw_mouse_was_enabled = raw;
     });
     controller->set_mouse_button_callback([&](merian::InputController&, merian::InputController::MouseButton button, merian::InputController::KeyStatus status, int){
         const int remap[] = {K_MOUSE1, K_MOUSE2, K_MOUSE3, K_MOUSE4, K_MOUSE5};
-        Key_Event(remap[button], status == merian::InputController::PRESS);
+        InputEvent event;
+        event.type = InputEvent::KEY;
+        event.key = remap[button];
+        event.down = status == merian::InputController::PRESS;
+        push_input_event(std::move(event));
     });
     controller->set_scroll_event_callback([&](merian::InputController&, double xoffset, double yoffset){
+        int key;
         if (yoffset > 0) {
-            Key_Event(K_MWHEELUP, true);
-            Key_Event(K_MWHEELUP, false);
+            key = K_MWHEELUP;
         } else if (xoffset < 0) {
-            Key_Event(K_MWHEELDOWN, true);
-            Key_Event(K_MWHEELDOWN, false);
+            key = K_MWHEELDOWN;
+        } else {
+            return;
+        }
+        for (const bool down : {true, false}) {
+            InputEvent event;
+            event.type = InputEvent::KEY;
+            event.key = key;
+            event.down = down;
+            push_input_event(std::move(event));
         }
     });
     // clang-format on
 }
 
+void QuakeNode::push_input_event(InputEvent&& event) {
+    event.timestamp = InputClock::now();
+    if (!input_events.push(std::move(event))) {
+        dropped_input_events++;
+        SPDLOG_WARN("input event queue full, event dropped");
+    }
+}
+
+void QuakeNode::drain_input_events() {
+    const InputClock::time_point now = InputClock::now();
+    for (InputEvent* event = input_events.front(); event != nullptr;
+         event = input_events.front()) {
+        input_latency.record(now - event->timestamp);
+        const bool is_command = event->type == InputEvent::COMMAND;
+
+        switch (event->type) {
+        case InputEvent::KEY:
+            Key_Event(event->key, event->down);
+            break;
+        case InputEvent::MOUSE_CURSOR:
+            this->mouse_x = event->x;
+            this->mouse_y = event->y;
+            if (event->reset) {
+                this->mouse_oldx = event->x;
+                this->mouse_oldy = event->y;
+            }
+            break;
+        case InputEvent::COMMAND:
+            Cmd_ExecuteString(event->command.c_str(), src_command);
+            break;
+        }
+
+        input_events.pop();
+        if (is_command)
+            break;
+    }
+}
+
 std::vector<merian_nodes::OutputConnectorHandle>
 QuakeNode::describe_outputs([[maybe_unused]] const merian_nodes::NodeIOLayout& io_layout) {
     con_resolution = merian_nodes::SpecialStaticOut<vk::Extent3D>::create(
@@ -715,10 +938,25 @@ void QuakeNode::process([[maybe_unused]] merian_nodes::GraphRun& run,
                         [[maybe_unused]] const merian_nodes::NodeIO& io) {
     const merian::CommandBufferHandle& cmd = run.get_cmd();
 
-    if (update_gamestate) {
+    // A frame that is in flight is completed even if the update was disabled meanwhile, the game
+    // state is only accessed while the game thread is halted.
+    if (update_gamestate || game_frame_in_flight) {
         MERIAN_PROFILE_SCOPE(run.get_profiler(), "update gamestate");
-        sync_render.push((float)run.get_time_delta(), 1);
+        // with async simulation the game thread hands over the state after its current tick
+        render_requested = true;
+        if (!game_frame_in_flight)
+            sync_render.push((float)run.get_time_delta(), 1);
         sync_gamestate.pop();
+        render_requested = false;
+        game_frame_in_flight = false;
+    }
+
+    if (!game_frame_in_flight && worldspawn_pending.exchange(false)) {
+        parse_worldspawn();
+        clear_alias_pose_caches();
+
+        last_worldspawn_frame = frame;
+        render_info.constant_data_update = true;
     }
 
     {
@@ -735,9 +973,28 @@ void QuakeNode::process([[maybe_unused]] merian_nodes::GraphRun& run,
 
         {
             MERIAN_PROFILE_SCOPE_GPU(run.get_profiler(), cmd, "update static geo");
-            update_static_geo(cmd);
+            update_static_geo(cmd, *run.get_thread_pool());
         }
     }
+    if ((cl.worldmodel != nullptr) && cl.num_statics != baked_num_statics) {
+        MERIAN_PROFILE_SCOPE_GPU(run.get_profiler(), cmd, "update static entity geo");
+        update_static_entity_geo(cmd);
+    }
+    if (run_extraction_benchmark) {
+        extraction_benchmark_result = benchmark_extraction(*run.get_thread_pool());
+        run_extraction_benchmark = false;
+    }
+    if (run_alias_verification) {
+        alias_verify_result = verify_alias_entities();
+        run_alias_verification = false;
+    }
+    if (run_particle_verification) {
+        particle_verify_result = fmt::format(
+            "verified {} particles: {} mismatches", count_particles(),
+            verify_particle_expansion(texnum_blood, texnum_explosion, reproducible_renders,
+                                      render_info.uniform.cl_time));
+        run_particle_verification = false;
+    }
     {
         MERIAN_PROFILE_SCOPE_GPU(run.get_profiler(), cmd, "update dynamic geo");
         update_dynamic_geo(run, cmd, run.get_profiler());
@@ -781,9 +1038,13 @@ void QuakeNode::process([[maybe_unused]] merian_nodes::GraphRun& run,
         render_info.uniform.prev_cam_x_mu_sx = render_info.uniform.cam_x_mu_t;
         render_info.uniform.prev_cam_w_mu_sy = render_info.uniform.cam_w;
         render_info.uniform.prev_cam_u_mu_sz = render_info.uniform.cam_u;
+        view_angles = *merian::as_vec3(r_refdef.viewangles);
+        vec3_t cam_angles;
+        VectorCopy(r_refdef.viewangles, cam_angles);
+        if (late_latch_camera)
+            late_latch_view_angles(cam_angles);
         float rgt[3];
-        AngleVectors(r_refdef.viewangles, &render_info.uniform.cam_w.x, rgt,
-                     &render_info.uniform.cam_u.x);
+        AngleVectors(cam_angles, &render_info.uniform.cam_w.x, rgt, &render_info.uniform.cam_u.x);
         render_info.uniform.cam_x_mu_t = glm::vec4(*merian::as_vec3(r_refdef.vieworg), 1);
         render_info.uniform.sky.fill(notexture->texnum);
         if (!render_info.render) {
@@ -842,20 +1103,102 @@ void QuakeNode::process([[maybe_unused]] merian_nodes::GraphRun& run,
     }
 
     frame++;
+
+    if ((pipeline_game_frame || async_simulation) && update_gamestate) {
+        // the game state is not accessed until the next process, simulate the next frame meanwhile
+        sync_render.push((float)run.get_time_delta(), 1);
+        game_frame_in_flight = true;
+    }
 }
 
-void QuakeNode::update_static_geo(const merian::CommandBufferHandle& cmd) {
+// More ranges than threads to balance the uneven cost of the surfaces.
+static constexpr uint32_t WORLD_RANGES_PER_THREAD = 4;
+
+// Concatenates the parts in order into vtx, idx and ext and rebases the indices. The offsets are a
+// prefix sum over the parts, which are then copied in parallel. The previous vertices are not
+// needed for static geometry and are not copied.
+static void concat_static_geometry(const std::vector<const QuakeNode::ThreadGeometry*>& parts,
+                                   std::vector<float>& vtx,
+                                   std::vector<uint32_t>& idx,
+                                   std::vector<VertexExtraData>& ext,
+                                   merian::ThreadPool& thread_pool) {
+    std::vector<uint32_t> vertex_offsets(parts.size() + 1, 0);
+    std::vector<uint32_t> index_offsets(parts.size() + 1, 0);
+    for (std::size_t i = 0; i < parts.size(); i++) {
+        vertex_offsets[i + 1] = vertex_offsets[i] + parts[i]->vtx.size() / 3;
+        index_offsets[i + 1] = index_offsets[i] + parts[i]->idx.size();
+    }
+
+    vtx.resize(3 * vertex_offsets.back());
+    idx.resize(index_offsets.back());
+    ext.resize(index_offsets.back() / 3);
+
+    merian::parallel_for(
+        parts.size(),
+        [&](const uint32_t i, [[maybe_unused]] const uint32_t) {
+            const QuakeNode::ThreadGeometry& part = *parts[i];
+            std::copy(part.vtx.begin(), part.vtx.end(), vtx.begin() + 3 * vertex_offsets[i]);
+            std::copy(part.ext.begin(), part.ext.end(), ext.begin() + index_offsets[i] / 3);
+            for (std::size_t j = 0; j < part.idx.size(); j++)
+                idx[index_offsets[i] + j] = vertex_offsets[i] + part.idx[j];
+        },
+        thread_pool, thread_pool.size());
+}
+
+void QuakeNode::update_static_geo(const merian::CommandBufferHandle& cmd,
+                                  merian::ThreadPool& thread_pool) {
     std::vector<RTGeometry> old_static_geo = static_geo;
     static_geo.clear();
+    welded_vertices = 0;
+
+    // the alias models might have changed
+    alias_pose_data_valid = false;
+
+    // The world surfaces are split into ranges that are triangulated in parallel, each into an
+    // opaque and an alpha tested part (even and odd entries). Concatenating the parts in order
+    // gives the same geometry as a serial pass.
+    std::vector<ThreadGeometry> world_geo;
+    {
+        qmodel_t* world = cl_entities->model;
+        glm::mat4 mat_model;
+        glm::mat4 mat_prev_model;
+        setup_brush_transforms(cl_entities, mat_model, mat_prev_model);
+
+        const uint32_t surface_count = world->nummodelsurfaces;
+        const uint32_t range_count =
+            std::min<uint32_t>(surface_count, WORLD_RANGES_PER_THREAD * thread_pool.size());
+        world_geo.resize(2 * range_count);
+
+        merian::parallel_for(
+            range_count,
+            [&](const uint32_t i, [[maybe_unused]] const uint32_t) {
+                ThreadGeometry& opaque = world_geo[2 * i];
+                ThreadGeometry& alpha = world_geo[2 * i + 1];
+                add_geo_brush_surfaces(
+                    world, mat_model, mat_prev_model, cl_entities->frame,
+                    (uint64_t)surface_count * i / range_count,
+                    (uint64_t)surface_count * (i + 1) / range_count,
+                    {opaque.vtx, opaque.prev_vtx, opaque.idx, opaque.ext},
+                    {alpha.vtx, alpha.prev_vtx, alpha.idx, alpha.ext});
+            },
+            thread_pool, thread_pool.size());
+    }
+    std::vector<const ThreadGeometry*> opaque_parts;
+    std::vector<const ThreadGeometry*> alpha_parts;
+    for (std::size_t i = 0; i < world_geo.size(); i += 2) {
+        opaque_parts.emplace_back(&world_geo[i]);
+        alpha_parts.emplace_back(&world_geo[i + 1]);
+    }
 
     vtx.clear();
     prev_vtx.clear();
     idx.clear();
     ext.clear();
 
-    add_geo_brush(cl_entities, cl_entities->model, vtx, prev_vtx, idx, ext, 1);
+    concat_static_geometry(opaque_parts, vtx, idx, ext, thread_pool);
     SPDLOG_DEBUG("static opaque geo: vtx size: {} idx size: {} ext size: {}", vtx.size(),
                  idx.size(), ext.size());
+    weld_static_vertices();
 
     if (!idx.empty()) {
         RTGeometry old_geo = old_static_geo.size() > 0 ? old_static_geo[0] : RTGeometry();
@@ -865,7 +1208,7 @@ void QuakeNode::update_static_geo(const merian::CommandBufferHandle& cmd) {
             flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowDataAccess;
         }
         static_geo.emplace_back(
-            get_rt_geometry(allocator, cmd, vtx, vtx, idx, ext, old_geo, flags));
+            get_static_rt_geometry(allocator, cmd, vtx, idx, ext, old_geo, flags));
         static_geo.back().instance_flags =
             vk::GeometryInstanceFlagBitsKHR::eTriangleFrontCounterclockwise |
             vk::GeometryInstanceFlagBitsKHR::eForceOpaque;
@@ -876,9 +1219,10 @@ void QuakeNode::update_static_geo(const merian::CommandBufferHandle& cmd) {
     idx.clear();
     ext.clear();
 
-    add_geo_brush(cl_entities, cl_entities->model, vtx, prev_vtx, idx, ext, 2);
+    concat_static_geometry(alpha_parts, vtx, idx, ext, thread_pool);
     SPDLOG_DEBUG("static non-opaque geo: vtx size: {} idx size: {} ext size: {}", vtx.size(),
                  idx.size(), ext.size());
+    weld_static_vertices();
     if (!idx.empty()) {
         RTGeometry old_geo = old_static_geo.size() > 1 ? old_static_geo[1] : RTGeometry();
         vk::BuildAccelerationStructureFlagsKHR flags =
@@ -887,10 +1231,171 @@ void QuakeNode::update_static_geo(const merian::CommandBufferHandle& cmd) {
             flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowDataAccess;
         }
         static_geo.emplace_back(
-            get_rt_geometry(allocator, cmd, vtx, vtx, idx, ext, old_geo, flags));
+            get_static_rt_geometry(allocator, cmd, vtx, idx, ext, old_geo, flags));
         static_geo.back().instance_flags =
             vk::GeometryInstanceFlagBitsKHR::eTriangleFrontCounterclockwise;
     }
+
+    // Brush submodels in model space. Models with animated textures stay in the dynamic geometry
+    // since their extra data depends on time and entity frame.
+    submodel_geo.clear();
+    entity_t model_space_ent{};
+    for (int i = 1; i < MAX_MODELS; i++) {
+        qmodel_t* m = cl.model_precache[i];
+        if (m == nullptr || m->type != mod_brush || m->name[0] != '*' ||
+            brush_model_has_animated_textures(m))
+            continue;
+
+        vtx.clear();
+        prev_vtx.clear();
+        idx.clear();
+        ext.clear();
+
+        model_space_ent.model = m;
+        add_geo_brush(&model_space_ent, m, vtx, prev_vtx, idx, ext);
+        if (idx.empty())
+            continue;
+
+        vk::BuildAccelerationStructureFlagsKHR flags =
+            vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+        if (context->get_extension<merian::ExtensionVkRayTracingPositionFetch>()) {
+            flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowDataAccess;
+        }
+        SubmodelGeometry& submodel = submodel_geo[m];
+        submodel.geo = get_static_rt_geometry(allocator, cmd, vtx, idx, ext, RTGeometry(), flags);
+        submodel.geo.instance_flags =
+            vk::GeometryInstanceFlagBitsKHR::eTriangleFrontCounterclockwise;
+        submodel.vtx = vtx;
+    }
+    SPDLOG_DEBUG("brush submodels with own BLAS: {}", submodel_geo.size());
+
+    submodel_instances.clear();
+    submodel_instance_count = 0;
+    // models are reloaded, cached keys may refer to freed models
+    entity_geometry_cache.clear();
+    entity_ranges.clear();
+    transient_entity_ranges.clear();
+    entity_vertex_ranges.reset();
+    entity_primitive_ranges.reset();
+
+    // static entities are spawned after the world, rebuild them whenever their count changes.
+    baked_num_statics = -1;
+
+    // the world is usually by far the largest geometry, let the arenas regrow for the frames.
+    update_arena_stats();
+    if (shrink_arenas)
+        release_arenas();
+}
+
+// 1/64 units, far below the precision of the BSP vertices (which are shared exactly).
+static constexpr float WELD_QUANTIZATION = 64;
+
+void QuakeNode::weld_static_vertices() {
+    if (!weld_static_geometry || vtx.empty())
+        return;
+
+    const uint32_t vertex_count = vtx.size() / 3;
+    const uint32_t removed = weld_vertices(vtx, idx, WELD_QUANTIZATION);
+    welded_vertices += removed;
+    SPDLOG_INFO("welded static geo: {} -> {} vertices ({:.1f}% removed, {:.2f} MiB saved)",
+                vertex_count, vertex_count - removed, 100. * removed / vertex_count,
+                removed * 3 * sizeof(float) / (1024. * 1024.));
+}
+
+void QuakeNode::update_arena_stats() {
+    arena_bytes = vtx.capacity() * sizeof(float) + prev_vtx.capacity() * sizeof(float) +
+                  idx.capacity() * sizeof(uint32_t) + ext.capacity() * sizeof(VertexExtraData) +
+                  particle_geo.capacity_bytes();
+    for (const ThreadGeometry& geo : thread_geo)
+        arena_bytes += geo.capacity_bytes();
+    arena_peak_bytes = std::max(arena_peak_bytes, arena_bytes);
+}
+
+void QuakeNode::release_arenas() {
+    vtx.clear();
+    prev_vtx.clear();
+    idx.clear();
+    ext.clear();
+    vtx.shrink_to_fit();
+    prev_vtx.shrink_to_fit();
+    idx.shrink_to_fit();
+    ext.shrink_to_fit();
+    particle_geo.release();
+    for (ThreadGeometry& geo : thread_geo)
+        geo.release();
+    update_arena_stats();
+}
+
+// Covers minStorageBufferOffsetAlignment of all devices.
+static constexpr vk::DeviceSize UPLOAD_RING_ALIGNMENT = 256;
+static constexpr vk::DeviceSize UPLOAD_RING_MIN_CAPACITY = 1 << 20;
+
+vk::DescriptorBufferInfo QuakeNode::upload_to_ring(const void* data, const vk::DeviceSize size) {
+    std::optional<uint64_t> offset = upload_ring.allocate(size, UPLOAD_RING_ALIGNMENT);
+    if (!offset) {
+        // the old buffer might still be read by the frames in flight and the current frame.
+        if (upload_ring_buffer)
+            retired_upload_ring_buffers.emplace_back(upload_ring_frame, upload_ring_buffer);
+        upload_ring_buffer = nullptr;
+
+        vk::DeviceSize capacity = std::max(
+            {UPLOAD_RING_MIN_CAPACITY, 2 * upload_ring.get_capacity(), 4 * size});
+        capacity = (capacity + UPLOAD_RING_ALIGNMENT - 1) / UPLOAD_RING_ALIGNMENT *
+                   UPLOAD_RING_ALIGNMENT;
+        allocator->ensureBufferSize(upload_ring_buffer, capacity,
+                                    vk::BufferUsageFlagBits::eStorageBuffer, "Quake: upload ring",
+                                    merian::MemoryMappingType::HOST_ACCESS_SEQUENTIAL_WRITE);
+        upload_ring.reset(capacity);
+        SPDLOG_DEBUG("upload ring grown to {} KiB", capacity / 1024);
+
+        offset = upload_ring.allocate(size, UPLOAD_RING_ALIGNMENT);
+        assert(offset);
+    }
+
+    std::byte* mapped = upload_ring_buffer->get_memory()->map_as<std::byte>();
+    std::memcpy(mapped + *offset, data, size);
+    upload_ring_buffer->get_memory()->unmap();
+
+    return vk::DescriptorBufferInfo{*upload_ring_buffer, *offset, size};
+}
+
+void QuakeNode::update_static_entity_geo(const merian::CommandBufferHandle& cmd) {
+    std::vector<RTGeometry> old_static_entity_geo = static_entity_geo;
+    static_entity_geo.clear();
+    animated_statics.clear();
+    baked_num_statics = cl.num_statics;
+
+    vtx.clear();
+    prev_vtx.clear();
+    idx.clear();
+    ext.clear();
+
+    for (int i = 0; i < cl.num_statics; i++) {
+        entity_t* ent = cl_static_entities + i;
+        if (!bake_static_entities || static_entity_animates(ent)) {
+            animated_statics.emplace_back(ent);
+            continue;
+        }
+        add_geo(ent, vtx, prev_vtx, idx, ext);
+    }
+    SPDLOG_DEBUG("static entity geo: {} baked, {} animated, vtx size: {} idx size: {}",
+                 cl.num_statics - animated_statics.size(), animated_statics.size(), vtx.size(),
+                 idx.size());
+
+    if (!idx.empty()) {
+        RTGeometry old_geo =
+            old_static_entity_geo.size() > 0 ? old_static_entity_geo[0] : RTGeometry();
+        vk::BuildAccelerationStructureFlagsKHR flags =
+            vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+        if (context->get_extension<merian::ExtensionVkRayTracingPositionFetch>()) {
+            flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowDataAccess;
+        }
+        // the entities do not move, the previous positions are the current positions.
+        static_entity_geo.emplace_back(
+            get_static_rt_geometry(allocator, cmd, vtx, idx, ext, old_geo, flags));
+        static_entity_geo.back().instance_flags =
+            vk::GeometryInstanceFlagBitsKHR::eTriangleFrontCounterclockwise;
+    }
 }
 
 void QuakeNode::update_dynamic_geo(merian_nodes::GraphRun& run,
@@ -901,58 +1406,200 @@ void QuakeNode::update_dynamic_geo(merian_nodes::GraphRun& run,
     idx.clear();
     ext.clear();
 
+    upload_ring_frame++;
+    upload_ring.begin_frame(run.get_in_flight_index());
+    std::erase_if(retired_upload_ring_buffers, [&](const auto& retired) {
+        return retired.first + upload_ring.get_frames_in_flight() < upload_ring_frame;
+    });
+
+    if (gpu_alias_expansion && !alias_pose_data_valid && cl.worldmodel != nullptr) {
+        MERIAN_PROFILE_SCOPE_GPU(profiler, cmd, "upload alias poses");
+        alias_pose_data.build();
+        alias_pose_buffer =
+            ensure_buffer(allocator, vk::BufferUsageFlagBits::eStorageBuffer, cmd,
+                          alias_pose_data.get_data(), alias_pose_buffer, {}, "Quake: alias poses");
+        cmd->barrier(vk::PipelineStageFlagBits::eTransfer,
+                     vk::PipelineStageFlagBits::eComputeShader,
+                     alias_pose_buffer->buffer_barrier(vk::AccessFlagBits::eTransferWrite,
+                                                       vk::AccessFlagBits::eShaderRead));
+        alias_pose_data_valid = true;
+    }
+    const bool expand_alias_on_gpu = gpu_alias_expansion && alias_pose_data_valid;
+
     const uint32_t number_tasks = run.get_thread_pool()->size();
-    std::vector<std::vector<float>> thread_dynamic_vtx(number_tasks);
-    std::vector<std::vector<float>> thread_dynamic_prev_vtx(number_tasks);
-    std::vector<std::vector<uint32_t>> thread_dynamic_idx(number_tasks);
-    std::vector<std::vector<VertexExtraData>> thread_dynamic_ext(number_tasks);
+    thread_geo.resize(number_tasks);
+    for (ThreadGeometry& geo : thread_geo)
+        geo.clear();
+    particle_geo.clear();
 
     {
-        MERIAN_PROFILE_SCOPE(profiler, "parallel transform");
-        std::future<void> future = run.get_thread_pool()->submit<void>([&]() {
-            if (playermodel == 1) {
-                add_geo(&cl.viewent, vtx, prev_vtx, idx, ext);
-            } else if (playermodel == 2) {
-                add_geo(&cl.viewent, vtx, prev_vtx, idx, ext);
-                add_geo(&cl_entities[cl.viewentity], vtx, prev_vtx, idx, ext);
+        MERIAN_PROFILE_SCOPE(profiler, "resolve entities");
+        resolve_dynamic_entities();
+        entity_cache_hits = 0;
+        entity_slices.assign(dynamic_entities.size(), EntitySlice{});
+    }
+
+    // alias models are recorded as instance if possible, brush submodels are instanced using their
+    // own BLAS, everything else is added on the CPU.
+    const auto add_entity_geo = [&](const uint32_t index, const uint32_t thread_index) {
+        entity_t* ent = dynamic_entities[index];
+        if (dynamic_submodel_slots[index] >= 0) {
+            SubmodelInstance& instance = submodel_instances[dynamic_submodel_slots[index]];
+            setup_brush_transforms(ent, instance.mat_model, instance.mat_prev_model);
+            instance.prev_vtx.clear();
+            if (instance.mat_model != instance.mat_prev_model) {
+                // previous positions in the current model space, such that the object to world
+                // transform of the instance yields the previous world positions
+                const glm::mat4 model_to_prev =
+                    glm::inverse(instance.mat_model) * instance.mat_prev_model;
+                const std::vector<float>& model_vtx = instance.submodel->vtx;
+                instance.prev_vtx.resize(model_vtx.size());
+                for (std::size_t v = 0; v < model_vtx.size(); v += 3) {
+                    const glm::vec3 prev_pos =
+                        model_to_prev *
+                        glm::vec4(model_vtx[v], model_vtx[v + 1], model_vtx[v + 2], 1);
+                    instance.prev_vtx[v] = prev_pos.x;
+                    instance.prev_vtx[v + 1] = prev_pos.y;
+                    instance.prev_vtx[v + 2] = prev_pos.z;
+                }
             }
-            add_particles(vtx, prev_vtx, idx, ext, texnum_blood, texnum_explosion,
-                          reproducible_renders, render_info.uniform.cl_time);
-        });
+            return;
+        }
+        ResolvedAliasModel& resolved = dynamic_alias_models[index];
+        if (expand_alias_on_gpu && resolved.hdr != nullptr) {
+            const AliasModelData* model_data = alias_pose_data.find(ent->model);
+            if (model_data != nullptr) {
+                AliasInstance instance;
+                if (make_alias_instance(ent, resolved.hdr, *model_data, instance))
+                    thread_geo[thread_index].alias_instances.emplace_back(instance);
+                return;
+            }
+        }
+        ThreadGeometry& geo = thread_geo[thread_index];
+        EntityGeometryCache* cache = dynamic_entity_caches[index];
+        EntityGeometryKey key;
+        if (cache == nullptr || !entity_geometry_key(ent, &resolved, key)) {
+            if (cache != nullptr)
+                cache->valid = false;
+            add_geo(ent, geo.vtx, geo.prev_vtx, geo.idx, geo.ext, &resolved);
+            return;
+        }
 
-        merian::parallel_for(
-            std::max(cl_numvisedicts, cl.num_statics),
-            [&](uint32_t index, uint32_t thread_index) {
-                if (index < (uint32_t)cl_numvisedicts)
-                    add_geo(cl_visedicts[index], thread_dynamic_vtx[thread_index],
-                            thread_dynamic_prev_vtx[thread_index], thread_dynamic_idx[thread_index],
-                            thread_dynamic_ext[thread_index]);
-                if (index < (uint32_t)cl.num_statics)
-                    add_geo(cl_static_entities + index, thread_dynamic_vtx[thread_index],
-                            thread_dynamic_prev_vtx[thread_index], thread_dynamic_idx[thread_index],
-                            thread_dynamic_ext[thread_index]);
-            },
-            *run.get_thread_pool(), number_tasks);
+        const uint32_t vtx_cnt = geo.vtx.size() / 3;
+        if (cache->valid && cache->key == key) {
+            // unchanged, the previous vertices equal the vertices
+            entity_cache_hits++;
+            geo.vtx.insert(geo.vtx.end(), cache->vtx.begin(), cache->vtx.end());
+            geo.prev_vtx.insert(geo.prev_vtx.end(), cache->vtx.begin(), cache->vtx.end());
+            geo.ext.insert(geo.ext.end(), cache->ext.begin(), cache->ext.end());
+            const std::size_t idx_size = geo.idx.size();
+            geo.idx.resize(idx_size + cache->idx.size());
+            for (std::size_t i = 0; i < cache->idx.size(); i++)
+                geo.idx[idx_size + i] = vtx_cnt + cache->idx[i];
+            return;
+        }
 
-        future.get();
-    }
+        const std::size_t idx_size = geo.idx.size();
+        const std::size_t ext_size = geo.ext.size();
+        add_geo(ent, geo.vtx, geo.prev_vtx, geo.idx, geo.ext, &resolved);
+        cache->key = key;
+        cache->valid = true;
+        cache->vtx.assign(geo.vtx.begin() + 3 * vtx_cnt, geo.vtx.end());
+        cache->ext.assign(geo.ext.begin() + ext_size, geo.ext.end());
+        cache->idx.resize(geo.idx.size() - idx_size);
+        for (std::size_t i = 0; i < cache->idx.size(); i++)
+            cache->idx[i] = geo.idx[idx_size + i] - vtx_cnt;
+    };
+    // records where the CPU geometry of the entity ends up in thread_geo
+    const auto add_entity = [&](const uint32_t index, const uint32_t thread_index) {
+        const ThreadGeometry& geo = thread_geo[thread_index];
+        EntitySlice& slice = entity_slices[index];
+        slice.thread = thread_index;
+        slice.vertex_begin = geo.vtx.size() / 3;
+        slice.index_begin = geo.idx.size();
+        add_entity_geo(index, thread_index);
+        slice.vertex_count = geo.vtx.size() / 3 - slice.vertex_begin;
+        slice.index_count = geo.idx.size() - slice.index_begin;
+    };
 
     {
-        MERIAN_PROFILE_SCOPE(profiler, "merge");
-        for (uint32_t i = 0; i < number_tasks; i++) {
-            uint32_t old_vtx_count = vtx.size() / 3;
-
-            merian::raw_copy_back(vtx, thread_dynamic_vtx[i]);
-            merian::raw_copy_back(prev_vtx, thread_dynamic_prev_vtx[i]);
-            merian::raw_copy_back(ext, thread_dynamic_ext[i]);
+        MERIAN_PROFILE_SCOPE(profiler, "parallel transform");
+        const uint32_t particle_count = count_particles();
+        const auto add_particle_geo = [&]() {
+            const float keep_probability =
+                particle_keep_probability(particle_count, particle_budget);
+            if (gpu_particle_expansion) {
+                make_particle_records(particle_records, texnum_blood, texnum_explosion,
+                                      reproducible_renders, render_info.uniform.cl_time,
+                                      keep_probability);
+                particles_kept = particle_records.size();
+            } else {
+                particle_records.clear();
+                particles_kept = add_particles(particle_geo.vtx, particle_geo.prev_vtx,
+                                               particle_geo.idx, particle_geo.ext, texnum_blood,
+                                               texnum_explosion, reproducible_renders,
+                                               render_info.uniform.cl_time, keep_probability);
+            }
+            particles_dropped = particle_count - particles_kept;
+        };
 
-            uint32_t old_idx_size = idx.size();
-            idx.resize(old_idx_size + thread_dynamic_idx[i].size());
-            for (uint32_t j = 0; j < thread_dynamic_idx[i].size(); j++) {
-                idx[old_idx_size + j] = old_vtx_count + thread_dynamic_idx[i][j];
+        // The most expensive items are picked up first, the cheap ones balance the workers at the
+        // end (longest processing time first with dynamic assignment).
+        const uint32_t particle_item = dynamic_entities.size();
+        const auto item_cost = [&](const uint32_t item) {
+            // 4 vertices and primitives each, records are cheaper
+            return item == particle_item ? (gpu_particle_expansion ? 1 : 8) * particle_count
+                                         : dynamic_entity_costs[item];
+        };
+        dynamic_work_order.resize(dynamic_entities.size() + 1);
+        std::iota(dynamic_work_order.begin(), dynamic_work_order.end(), 0);
+        std::stable_sort(dynamic_work_order.begin(), dynamic_work_order.end(),
+                         [&](const uint32_t a, const uint32_t b) {
+                             return item_cost(a) > item_cost(b);
+                         });
+
+        std::atomic_uint32_t next_item = 0;
+        const auto worker = [&](const uint32_t thread_index, [[maybe_unused]] const uint32_t) {
+            for (uint32_t i = next_item++; i < dynamic_work_order.size(); i = next_item++) {
+                const uint32_t item = dynamic_work_order[i];
+                if (item == particle_item)
+                    add_particle_geo();
+                else
+                    add_entity(item, thread_index);
             }
+        };
+        merian::parallel_for(number_tasks, worker, *run.get_thread_pool(), number_tasks);
+    }
+
+    {
+        MERIAN_PROFILE_SCOPE(profiler, "entity ranges");
+        assign_entity_ranges();
+    }
+
+    // the CPU particles are placed after the entity ranges
+    const uint32_t particle_geo_vertex_offset = entity_vertex_ranges.size();
+    const uint32_t particle_geo_primitive_offset = entity_primitive_ranges.size();
+    const uint32_t cpu_vertex_count = particle_geo_vertex_offset + particle_geo.vtx.size() / 3;
+    const uint32_t cpu_primitive_count = particle_geo_primitive_offset + particle_geo.ext.size();
+
+    // the expanded alias geometry is placed after the CPU geometry
+    uint32_t vertex_count = cpu_vertex_count;
+    uint32_t primitive_count = cpu_primitive_count;
+    alias_instances.clear();
+    for (uint32_t i = 0; i < number_tasks; i++) {
+        for (AliasInstance& instance : thread_geo[i].alias_instances) {
+            instance.vertex_offset = vertex_count;
+            instance.primitive_offset = primitive_count;
+            vertex_count += instance.numverts_vbo;
+            primitive_count += instance.numindexes / 3;
+            alias_instances.emplace_back(instance);
         }
     }
+    // followed by the expanded particles, 4 vertices and primitives each
+    particle_vertex_offset = vertex_count;
+    particle_primitive_offset = primitive_count;
+    vertex_count += 4 * particle_records.size();
+    primitive_count += 4 * particle_records.size();
 
     // for (int i=1 ; i<MAX_MODELS ; i++)
     //     add_geo(cl.model_precache+i, p->vtx + 3*vtx_cnt, p->idx + idx_cnt, 0, &vtx_cnt,
@@ -960,26 +1607,580 @@ void QuakeNode::update_dynamic_geo(merian_nodes::GraphRun& run,
     // for (int i=0; i<cl_max_edicts; i++)
     //     add_geo(cl_entities+i, p->vtx + 3*vtx_cnt, p->idx + idx_cnt, 0, &vtx_cnt, &idx_cnt);
 
-    SPDLOG_TRACE("dynamic geo: vtx size: {} idx size: {} ext size: {}", dynamic_vtx.size(),
-                 dynamic_idx.size(), dynamic_ext.size());
+    const RTGeometry old_geo = dynamic_geo.empty() ? RTGeometry() : dynamic_geo[0];
+    dynamic_geo.clear();
+    vk::BuildAccelerationStructureFlagsKHR flags =
+        vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild;
+    if (context->get_extension<merian::ExtensionVkRayTracingPositionFetch>()) {
+        flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowDataAccess;
+    }
+
+    // destination of the merge: the mapped buffers of this frame in flight or the vectors, which
+    // are uploaded afterwards.
+    const bool mapped = mapped_dynamic_upload && primitive_count > 0;
+    const bool motion_delta = mapped && compact_motion;
+    float* out_vtx;
+    float* out_prev_vtx;
+    uint32_t* out_idx;
+    VertexExtraData* out_ext;
+    if (mapped) {
+        const uint32_t in_flight_index = run.get_in_flight_index();
+        if (mapped_dynamic_buffers.size() <= in_flight_index)
+            mapped_dynamic_buffers.resize(in_flight_index + 1);
+        dynamic_geo.emplace_back(get_mapped_rt_geometry(
+            allocator, mapped_dynamic_buffers[in_flight_index], old_geo, flags, vertex_count,
+            primitive_count, motion_delta, out_vtx, out_prev_vtx, out_idx, out_ext));
+    } else {
+        vtx.resize(3 * cpu_vertex_count);
+        prev_vtx.resize(3 * cpu_vertex_count);
+        idx.resize(3 * cpu_primitive_count);
+        ext.resize(cpu_primitive_count);
+        out_vtx = vtx.data();
+        out_prev_vtx = prev_vtx.data();
+        out_idx = idx.data();
+        out_ext = ext.data();
+    }
 
     {
+        MERIAN_PROFILE_SCOPE(profiler, "merge");
+        // unused ranges become degenerate primitives
+        for (const auto& [offset, count] : entity_primitive_ranges.get_free_ranges()) {
+            std::fill(out_idx + 3 * offset, out_idx + 3 * (offset + count), 0);
+            std::fill(out_ext + offset, out_ext + offset + count, VertexExtraData{});
+        }
+
+        std::copy(particle_geo.vtx.begin(), particle_geo.vtx.end(),
+                  out_vtx + 3 * particle_geo_vertex_offset);
+        // writes the previous positions of count vertices
+        const auto write_prev_vtx = [&](const float* src_vtx, const float* src_prev_vtx,
+                                        const uint32_t count, const uint32_t vertex_offset) {
+            if (motion_delta) {
+                write_motion_deltas(src_vtx, src_prev_vtx, count, MOTION_DELTA_MAX,
+                                    reinterpret_cast<uint16_t*>(out_prev_vtx) + 4 * vertex_offset);
+            } else {
+                std::copy_n(src_prev_vtx, 3 * count, out_prev_vtx + 3 * vertex_offset);
+            }
+        };
+
+        write_prev_vtx(particle_geo.vtx.data(), particle_geo.prev_vtx.data(),
+                       particle_geo.vtx.size() / 3, particle_geo_vertex_offset);
+        std::copy(particle_geo.ext.begin(), particle_geo.ext.end(),
+                  out_ext + particle_geo_primitive_offset);
+        for (std::size_t j = 0; j < particle_geo.idx.size(); j++) {
+            out_idx[3 * particle_geo_primitive_offset + j] =
+                particle_geo_vertex_offset + particle_geo.idx[j];
+        }
+
+        // every entity is copied and rebased into its range in parallel
+        const auto merge_entity = [&](const uint32_t i, [[maybe_unused]] const uint32_t) {
+            const EntityRange* range = dynamic_entity_ranges[i];
+            if (range == nullptr)
+                return;
+            const EntitySlice& slice = entity_slices[i];
+            const ThreadGeometry& geo = thread_geo[slice.thread];
+            std::copy_n(geo.vtx.begin() + 3 * slice.vertex_begin, 3 * slice.vertex_count,
+                        out_vtx + 3 * range->vertex_offset);
+            write_prev_vtx(geo.vtx.data() + 3 * slice.vertex_begin,
+                           geo.prev_vtx.data() + 3 * slice.vertex_begin, slice.vertex_count,
+                           range->vertex_offset);
+            std::copy_n(geo.ext.begin() + slice.index_begin / 3, range->primitive_count,
+                        out_ext + range->primitive_offset);
+
+            uint32_t* entity_idx = out_idx + 3 * range->primitive_offset;
+            const uint32_t* slice_idx = geo.idx.data() + slice.index_begin;
+            for (uint32_t j = 0; j < slice.index_count; j++) {
+                entity_idx[j] = range->vertex_offset + slice_idx[j] - slice.vertex_begin;
+            }
+        };
+        merian::parallel_for(dynamic_entities.size(), merge_entity, *run.get_thread_pool(),
+                             number_tasks);
+    }
+
+    SPDLOG_TRACE("dynamic geo: vtx count: {} primitive count: {}", vertex_count, primitive_count);
+    update_arena_stats();
+
+    if (mapped) {
+        unmap_geometry_buffers(dynamic_geo.back());
+    } else if (primitive_count > 0) {
         MERIAN_PROFILE_SCOPE_GPU(profiler, cmd, "upload / copy");
-        std::vector<RTGeometry> old_dynamic_geo = dynamic_geo;
-        dynamic_geo.clear();
-        if (!idx.empty()) {
-            RTGeometry old_geo = old_dynamic_geo.size() > 0 ? old_dynamic_geo[0] : RTGeometry();
-            vk::BuildAccelerationStructureFlagsKHR flags =
-                vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild;
-            if (context->get_extension<merian::ExtensionVkRayTracingPositionFetch>()) {
-                flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowDataAccess;
+        RTGeometry old_upload_geo = old_geo;
+        if (!mapped_dynamic_buffers.empty()) {
+            // mapped upload was disabled, the mapped buffers might still be used by a frame in
+            // flight. Keep only the BLAS.
+            old_upload_geo.vtx = old_upload_geo.prev_vtx = nullptr;
+            old_upload_geo.idx = old_upload_geo.ext = nullptr;
+            mapped_dynamic_buffers.clear();
+        }
+        dynamic_geo.emplace_back(get_rt_geometry(allocator, cmd, vtx, prev_vtx, idx, ext,
+                                                 old_upload_geo, flags, vertex_count,
+                                                 primitive_count));
+    }
+    if (!dynamic_geo.empty()) {
+        dynamic_geo.back().instance_flags =
+            vk::GeometryInstanceFlagBitsKHR::eTriangleFrontCounterclockwise;
+    }
+
+    if (!alias_instances.empty() && !dynamic_geo.empty()) {
+        MERIAN_PROFILE_SCOPE_GPU(profiler, cmd, "expand alias instances");
+        expand_alias_instances(run, cmd, dynamic_geo.back());
+        dynamic_geo.back().write_access = vk::AccessFlagBits2::eShaderWrite;
+        dynamic_geo.back().write_stage = vk::PipelineStageFlagBits2::eComputeShader;
+    }
+
+    if (!particle_records.empty() && !dynamic_geo.empty()) {
+        MERIAN_PROFILE_SCOPE_GPU(profiler, cmd, "expand particles");
+        expand_particle_records(run, cmd, dynamic_geo.back());
+        dynamic_geo.back().write_access = vk::AccessFlagBits2::eShaderWrite;
+        dynamic_geo.back().write_stage = vk::PipelineStageFlagBits2::eComputeShader;
+    }
+
+    {
+        MERIAN_PROFILE_SCOPE_GPU(profiler, cmd, "submodel instances");
+        const uint32_t in_flight_index = run.get_in_flight_index();
+        submodel_instance_geo.clear();
+        for (uint32_t i = 0; i < submodel_instance_count; i++) {
+            SubmodelInstance& instance = submodel_instances[i];
+            RTGeometry geo = instance.submodel->geo;
+            geo.transform = to_transform_matrix(instance.mat_model);
+            if (!instance.prev_vtx.empty()) {
+                if (instance.prev_vtx_buffers.size() <= in_flight_index)
+                    instance.prev_vtx_buffers.resize(in_flight_index + 1);
+                merian::BufferHandle& prev_vtx_buffer = instance.prev_vtx_buffers[in_flight_index];
+                prev_vtx_buffer = ensure_buffer(allocator, vk::BufferUsageFlagBits::eStorageBuffer,
+                                                cmd, instance.prev_vtx, prev_vtx_buffer, {},
+                                                "Quake: submodel previous vertex buffer");
+                cmd->barrier(vk::PipelineStageFlagBits::eTransfer,
+                             vk::PipelineStageFlagBits::eComputeShader,
+                             prev_vtx_buffer->buffer_barrier(vk::AccessFlagBits::eTransferWrite,
+                                                             vk::AccessFlagBits::eShaderRead));
+                geo.prev_vtx = prev_vtx_buffer;
+            }
+            submodel_instance_geo.emplace_back(geo);
+        }
+    }
+}
+
+void QuakeNode::assign_entity_ranges() {
+    // the ranges are compacted if more than half of them are unused
+    static constexpr uint32_t MIN_COMPACTION_SIZE = 1 << 16;
+
+    entity_range_frame++;
+    for (const EntityRange& range : transient_entity_ranges) {
+        entity_vertex_ranges.free(range.vertex_offset, range.vertex_count);
+        entity_primitive_ranges.free(range.primitive_offset, range.primitive_count);
+    }
+    transient_entity_ranges.clear();
+    transient_entity_ranges.reserve(dynamic_entities.size());
+    dynamic_entity_ranges.assign(dynamic_entities.size(), nullptr);
+
+    // keep the ranges of entities with unchanged size
+    for (uint32_t i = 0; i < dynamic_entities.size(); i++) {
+        const EntitySlice& slice = entity_slices[i];
+        const auto it = entity_ranges.find(dynamic_entities[i]);
+        if (slice.index_count == 0 || it == entity_ranges.end())
+            continue;
+        EntityRange& range = it->second;
+        if (range.last_used == entity_range_frame)
+            continue;
+        range.last_used = entity_range_frame;
+        if (range.vertex_count == slice.vertex_count &&
+            range.primitive_count == slice.index_count / 3) {
+            dynamic_entity_ranges[i] = &range;
+        } else {
+            entity_vertex_ranges.free(range.vertex_offset, range.vertex_count);
+            entity_primitive_ranges.free(range.primitive_offset, range.primitive_count);
+            range.vertex_count = range.primitive_count = 0;
+        }
+    }
+    std::erase_if(entity_ranges, [&](const auto& entry) {
+        const EntityRange& range = entry.second;
+        if (range.last_used == entity_range_frame)
+            return false;
+        entity_vertex_ranges.free(range.vertex_offset, range.vertex_count);
+        entity_primitive_ranges.free(range.primitive_offset, range.primitive_count);
+        return true;
+    });
+
+    if (entity_primitive_ranges.size() > MIN_COMPACTION_SIZE &&
+        entity_primitive_ranges.size() > 2 * entity_primitive_ranges.allocated()) {
+        SPDLOG_DEBUG("compacting entity ranges: {} of {} primitives used",
+                     entity_primitive_ranges.allocated(), entity_primitive_ranges.size());
+        entity_ranges.clear();
+        entity_vertex_ranges.reset();
+        entity_primitive_ranges.reset();
+        dynamic_entity_ranges.assign(dynamic_entities.size(), nullptr);
+    }
+
+    // new entities and entities that changed their size get a new range
+    for (uint32_t i = 0; i < dynamic_entities.size(); i++) {
+        const EntitySlice& slice = entity_slices[i];
+        if (slice.index_count == 0 || dynamic_entity_ranges[i] != nullptr)
+            continue;
+        EntityRange* range = &entity_ranges[dynamic_entities[i]];
+        if (range->vertex_count > 0) {
+            // listed twice
+            range = &transient_entity_ranges.emplace_back();
+        }
+        range->vertex_count = slice.vertex_count;
+        range->primitive_count = slice.index_count / 3;
+        range->vertex_offset = entity_vertex_ranges.allocate(range->vertex_count);
+        range->primitive_offset = entity_primitive_ranges.allocate(range->primitive_count);
+        range->last_used = entity_range_frame;
+        dynamic_entity_ranges[i] = range;
+    }
+}
+
+void QuakeNode::collect_dynamic_entities(std::vector<entity_t*>& entities) const {
+    entities.clear();
+    if (playermodel == 1) {
+        entities.emplace_back(&cl.viewent);
+    } else if (playermodel == 2) {
+        entities.emplace_back(&cl.viewent);
+        entities.emplace_back(&cl_entities[cl.viewentity]);
+    }
+    for (int i = 0; i < cl_numvisedicts; i++)
+        entities.emplace_back(cl_visedicts[i]);
+    for (entity_t* ent : animated_statics)
+        entities.emplace_back(ent);
+}
+
+uint32_t QuakeNode::get_max_submodel_instances() const {
+    // brush submodels get a TLAS slot each after the static and the dynamic geometry
+    return MAX_GEOMETRIES - static_geo.size() - static_entity_geo.size() - 1;
+}
+
+void QuakeNode::resolve_dynamic_entities() {
+    collect_dynamic_entities(dynamic_entities);
+
+    // Mod_Extradata is only called here. This pins the headers until the next call.
+    dynamic_alias_models.resize(dynamic_entities.size());
+    for (uint32_t i = 0; i < dynamic_entities.size(); i++)
+        resolve_alias_model(dynamic_entities[i], dynamic_alias_models[i]);
+
+    // brush submodels get a TLAS slot each, if no slot is left they are added to the dynamic
+    // geometry.
+    const uint32_t max_submodel_instances = get_max_submodel_instances();
+    submodel_instance_count = 0;
+    submodel_overflow_count = 0;
+    dynamic_submodel_slots.assign(dynamic_entities.size(), -1);
+    for (uint32_t i = 0; submodel_instancing && i < dynamic_entities.size(); i++) {
+        const auto it = submodel_geo.find(dynamic_entities[i]->model);
+        if (it == submodel_geo.end())
+            continue;
+        if (submodel_instance_count == max_submodel_instances) {
+            submodel_overflow_count++;
+            continue;
+        }
+        if (submodel_instances.size() == submodel_instance_count)
+            submodel_instances.emplace_back();
+        submodel_instances[submodel_instance_count].submodel = &it->second;
+        dynamic_submodel_slots[i] = submodel_instance_count++;
+    }
+
+    // instances and GPU expanded alias models only cost the transforms
+    dynamic_entity_costs.resize(dynamic_entities.size());
+    for (uint32_t i = 0; i < dynamic_entities.size(); i++) {
+        if (dynamic_submodel_slots[i] >= 0 ||
+            (gpu_alias_expansion && dynamic_alias_models[i].hdr != nullptr)) {
+            dynamic_entity_costs[i] = 1;
+        } else {
+            dynamic_entity_costs[i] =
+                estimate_entity_cost(dynamic_entities[i], &dynamic_alias_models[i]);
+        }
+    }
+
+    entity_cache_frame++;
+    dynamic_entity_caches.assign(dynamic_entities.size(), nullptr);
+    if (!cache_entity_geometry) {
+        entity_geometry_cache.clear();
+        return;
+    }
+    for (uint32_t i = 0; i < dynamic_entities.size(); i++) {
+        if (dynamic_submodel_slots[i] >= 0)
+            continue;
+        EntityGeometryCache& cache = entity_geometry_cache[dynamic_entities[i]];
+        if (cache.last_used == entity_cache_frame) {
+            // listed twice, do not let two workers write the same entry
+            cache.valid = false;
+            continue;
+        }
+        cache.last_used = entity_cache_frame;
+        dynamic_entity_caches[i] = &cache;
+    }
+    std::erase_if(entity_geometry_cache, [&](const auto& entry) {
+        return entry.second.last_used != entity_cache_frame;
+    });
+}
+
+std::string QuakeNode::benchmark_extraction(merian::ThreadPool& thread_pool) {
+    static constexpr uint32_t iterations = 20;
+
+    // the entities that update_dynamic_geo adds on the CPU, without instanced submodels and GPU
+    // expanded alias models
+    std::vector<entity_t*> live_entities;
+    collect_dynamic_entities(live_entities);
+    const bool expand_alias_on_gpu = gpu_alias_expansion && alias_pose_data_valid;
+    uint32_t submodel_slots = 0;
+    std::vector<entity_t> entities;
+    std::vector<ResolvedAliasModel> alias_models;
+    entities.reserve(live_entities.size());
+    alias_models.reserve(live_entities.size());
+    for (entity_t* ent : live_entities) {
+        if (submodel_instancing && submodel_geo.contains(ent->model) &&
+            submodel_slots < get_max_submodel_instances()) {
+            submodel_slots++;
+            continue;
+        }
+        ResolvedAliasModel resolved;
+        resolve_alias_model(ent, resolved);
+        if (expand_alias_on_gpu && resolved.hdr != nullptr &&
+            alias_pose_data.find(ent->model) != nullptr)
+            continue;
+        entities.emplace_back(*ent);
+        alias_models.emplace_back(resolved);
+    }
+
+    // extraction advances the lerp and motion vector state, every iteration starts from a fresh
+    // copy of the entities and their transforms. The copy of the view model skips the fov scale,
+    // which costs the same.
+    std::vector<entity_t> iteration_entities;
+    std::vector<ResolvedAliasModel> iteration_alias_models;
+
+    const uint32_t max_threads = thread_pool.size();
+    std::vector<std::vector<float>> thread_vtx(max_threads);
+    std::vector<std::vector<float>> thread_prev_vtx(max_threads);
+    std::vector<std::vector<uint32_t>> thread_idx(max_threads);
+    std::vector<std::vector<VertexExtraData>> thread_ext(max_threads);
+
+    std::string result =
+        fmt::format("{} entities, {} iterations\n", entities.size(), iterations);
+    double single_thread_seconds = 0;
+    for (uint32_t number_tasks = 1; number_tasks <= max_threads; number_tasks++) {
+        double seconds = 0;
+        uint64_t primitive_count = 0;
+        for (uint32_t iteration = 0; iteration < iterations; iteration++) {
+            for (uint32_t i = 0; i < max_threads; i++) {
+                thread_vtx[i].clear();
+                thread_prev_vtx[i].clear();
+                thread_idx[i].clear();
+                thread_ext[i].clear();
             }
-            dynamic_geo.emplace_back(
-                get_rt_geometry(allocator, cmd, vtx, prev_vtx, idx, ext, old_geo, flags));
-            dynamic_geo.back().instance_flags =
-                vk::GeometryInstanceFlagBitsKHR::eTriangleFrontCounterclockwise;
+            iteration_entities = entities;
+            iteration_alias_models = alias_models;
+
+            merian::Stopwatch sw;
+            merian::parallel_for(
+                iteration_entities.size(),
+                [&](uint32_t index, uint32_t thread_index) {
+                    add_geo(&iteration_entities[index], thread_vtx[thread_index],
+                            thread_prev_vtx[thread_index], thread_idx[thread_index],
+                            thread_ext[thread_index], &iteration_alias_models[index]);
+                },
+                thread_pool, number_tasks);
+            seconds += sw.seconds();
+
+            for (uint32_t i = 0; i < max_threads; i++)
+                primitive_count += thread_ext[i].size();
         }
+
+        if (number_tasks == 1)
+            single_thread_seconds = seconds;
+        result += fmt::format("{} threads: {:.3f} ms, {:.2f} Mprims/s, speedup {:.2f}\n",
+                              number_tasks, seconds / iterations * 1000.,
+                              primitive_count / seconds / 1e6, single_thread_seconds / seconds);
     }
+
+    return result;
+}
+
+std::string QuakeNode::verify_alias_entities() {
+    AliasPoseData pose_data;
+    pose_data.build();
+    uint32_t entity_count = 0;
+    uint32_t mismatches = 0;
+    for (int i = 0; i < cl_numvisedicts; i++) {
+        const entity_t* ent = cl_visedicts[i];
+        if (ent->model == nullptr || ent->model->type != mod_alias)
+            continue;
+        const AliasModelData* model_data = pose_data.find(ent->model);
+        if (model_data == nullptr)
+            continue;
+        mismatches += verify_alias_expansion(ent, *model_data, pose_data.get_data());
+        entity_count++;
+    }
+    return fmt::format("verified {} alias entities: {} mismatches", entity_count, mismatches);
+}
+
+// Barriers before a compute shader writes expanded geometry into geo, after geo was uploaded. The
+// inputs are written by the host into the upload ring, these writes are visible at submit.
+static void record_expansion_pre_barriers(const merian::CommandBufferHandle& cmd,
+                                          const QuakeNode::RTGeometry& geo) {
+    // The upload barriers of the geometry only cover reads.
+    const std::array<vk::BufferMemoryBarrier2, 4> pre_barriers = {
+        geo.vtx->buffer_barrier2(
+            vk::PipelineStageFlagBits2::eTransfer, vk::PipelineStageFlagBits2::eComputeShader,
+            vk::AccessFlagBits2::eTransferWrite, vk::AccessFlagBits2::eShaderWrite),
+        geo.prev_vtx->buffer_barrier2(
+            vk::PipelineStageFlagBits2::eTransfer, vk::PipelineStageFlagBits2::eComputeShader,
+            vk::AccessFlagBits2::eTransferWrite, vk::AccessFlagBits2::eShaderWrite),
+        geo.idx->buffer_barrier2(
+            vk::PipelineStageFlagBits2::eTransfer, vk::PipelineStageFlagBits2::eComputeShader,
+            vk::AccessFlagBits2::eTransferWrite, vk::AccessFlagBits2::eShaderWrite),
+        geo.ext->buffer_barrier2(
+            vk::PipelineStageFlagBits2::eTransfer, vk::PipelineStageFlagBits2::eComputeShader,
+            vk::AccessFlagBits2::eTransferWrite, vk::AccessFlagBits2::eShaderWrite),
+    };
+    cmd->barrier(pre_barriers);
+}
+
+// Barriers after a compute shader wrote expanded geometry into geo.
+static void record_expansion_post_barriers(const merian::CommandBufferHandle& cmd,
+                                           const QuakeNode::RTGeometry& geo) {
+    const std::array<vk::BufferMemoryBarrier2, 4> post_barriers = {
+        geo.vtx->buffer_barrier2(vk::PipelineStageFlagBits2::eComputeShader,
+                                 vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR |
+                                     vk::PipelineStageFlagBits2::eComputeShader,
+                                 vk::AccessFlagBits2::eShaderWrite,
+                                 vk::AccessFlagBits2::eAccelerationStructureReadKHR |
+                                     vk::AccessFlagBits2::eShaderRead),
+        geo.prev_vtx->buffer_barrier2(
+            vk::PipelineStageFlagBits2::eComputeShader, vk::PipelineStageFlagBits2::eComputeShader,
+            vk::AccessFlagBits2::eShaderWrite, vk::AccessFlagBits2::eShaderRead),
+        geo.idx->buffer_barrier2(vk::PipelineStageFlagBits2::eComputeShader,
+                                 vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR |
+                                     vk::PipelineStageFlagBits2::eComputeShader,
+                                 vk::AccessFlagBits2::eShaderWrite,
+                                 vk::AccessFlagBits2::eAccelerationStructureReadKHR |
+                                     vk::AccessFlagBits2::eShaderRead),
+        geo.ext->buffer_barrier2(
+            vk::PipelineStageFlagBits2::eComputeShader, vk::PipelineStageFlagBits2::eComputeShader,
+            vk::AccessFlagBits2::eShaderWrite, vk::AccessFlagBits2::eShaderRead),
+    };
+    cmd->barrier(post_barriers);
+}
+
+void QuakeNode::expand_alias_instances(merian_nodes::GraphRun& run,
+                                       const merian::CommandBufferHandle& cmd,
+                                       const RTGeometry& geo) {
+    if (!alias_expand_pipe) {
+        alias_expand_layout =
+            merian::DescriptorSetLayoutBuilder()
+                .add_binding_storage_buffer()
+                .add_binding_storage_buffer()
+                .add_binding_storage_buffer()
+                .add_binding_storage_buffer()
+                .add_binding_storage_buffer()
+                .add_binding_storage_buffer()
+                .build_layout(context, vk::DescriptorSetLayoutCreateFlagBits::ePushDescriptorKHR);
+        const merian::ShaderModuleHandle shader =
+            run.get_shader_compiler()->find_compile_glsl_to_shadermodule(
+                context, "shader/game/alias_expand.comp");
+        const merian::PipelineLayoutHandle pipe_layout =
+            merian::PipelineLayoutBuilder(context)
+                .add_descriptor_set_layout(alias_expand_layout)
+                .build_pipeline_layout();
+        auto spec_builder = merian::SpecializationInfoBuilder();
+        spec_builder.add_entry(ALIAS_EXPAND_LOCAL_SIZE);
+        spec_builder.add_entry(static_cast<uint32_t>(compact_motion && mapped_dynamic_upload));
+        alias_expand_pipe =
+            std::make_shared<merian::ComputePipeline>(pipe_layout, shader, spec_builder.build());
+    }
+
+    const vk::DescriptorBufferInfo instance_info =
+        upload_to_ring(alias_instances.data(), merian::size_of(alias_instances));
+
+    record_expansion_pre_barriers(cmd, geo);
+
+    const std::array<vk::DescriptorBufferInfo, 6> buffer_infos = {
+        instance_info,
+        vk::DescriptorBufferInfo{*alias_pose_buffer, 0, VK_WHOLE_SIZE},
+        vk::DescriptorBufferInfo{*geo.vtx, 0, VK_WHOLE_SIZE},
+        vk::DescriptorBufferInfo{*geo.prev_vtx, 0, VK_WHOLE_SIZE},
+        vk::DescriptorBufferInfo{*geo.idx, 0, VK_WHOLE_SIZE},
+        vk::DescriptorBufferInfo{*geo.ext, 0, VK_WHOLE_SIZE},
+    };
+    std::vector<vk::WriteDescriptorSet> writes;
+    for (uint32_t binding = 0; binding < buffer_infos.size(); binding++) {
+        writes.emplace_back(VK_NULL_HANDLE, binding, 0, 1,
+                            alias_expand_layout->get_type_for_binding(binding), nullptr,
+                            &buffer_infos[binding], nullptr, nullptr);
+    }
+
+    // one row of workgroups per instance
+    uint32_t max_invocations = 0;
+    for (const AliasInstance& instance : alias_instances) {
+        max_invocations =
+            std::max({max_invocations, instance.numverts_vbo, instance.numindexes / 3});
+    }
+
+    cmd->bind(alias_expand_pipe);
+    cmd->push_descriptor_set(alias_expand_pipe, 0, writes);
+    cmd->dispatch((max_invocations + ALIAS_EXPAND_LOCAL_SIZE - 1) / ALIAS_EXPAND_LOCAL_SIZE,
+                  alias_instances.size(), 1);
+
+    record_expansion_post_barriers(cmd, geo);
+}
+
+void QuakeNode::expand_particle_records(merian_nodes::GraphRun& run,
+                                        const merian::CommandBufferHandle& cmd,
+                                        const RTGeometry& geo) {
+    if (!particle_expand_pipe) {
+        particle_expand_layout =
+            merian::DescriptorSetLayoutBuilder()
+                .add_binding_storage_buffer()
+                .add_binding_storage_buffer()
+                .add_binding_storage_buffer()
+                .add_binding_storage_buffer()
+                .add_binding_storage_buffer()
+                .build_layout(context, vk::DescriptorSetLayoutCreateFlagBits::ePushDescriptorKHR);
+        const merian::ShaderModuleHandle shader =
+            run.get_shader_compiler()->find_compile_glsl_to_shadermodule(
+                context, "shader/game/particle_expand.comp");
+        const merian::PipelineLayoutHandle pipe_layout =
+            merian::PipelineLayoutBuilder(context)
+                .add_descriptor_set_layout(particle_expand_layout)
+                .add_push_constant<ParticleExpandPushConstant>()
+                .build_pipeline_layout();
+        auto spec_builder = merian::SpecializationInfoBuilder();
+        spec_builder.add_entry(PARTICLE_EXPAND_LOCAL_SIZE);
+        spec_builder.add_entry(static_cast<uint32_t>(compact_motion && mapped_dynamic_upload));
+        particle_expand_pipe =
+            std::make_shared<merian::ComputePipeline>(pipe_layout, shader, spec_builder.build());
+    }
+
+    const vk::DescriptorBufferInfo record_info =
+        upload_to_ring(particle_records.data(), merian::size_of(particle_records));
+
+    record_expansion_pre_barriers(cmd, geo);
+
+    const std::array<vk::DescriptorBufferInfo, 5> buffer_infos = {
+        record_info,
+        vk::DescriptorBufferInfo{*geo.vtx, 0, VK_WHOLE_SIZE},
+        vk::DescriptorBufferInfo{*geo.prev_vtx, 0, VK_WHOLE_SIZE},
+        vk::DescriptorBufferInfo{*geo.idx, 0, VK_WHOLE_SIZE},
+        vk::DescriptorBufferInfo{*geo.ext, 0, VK_WHOLE_SIZE},
+    };
+    std::vector<vk::WriteDescriptorSet> writes;
+    for (uint32_t binding = 0; binding < buffer_infos.size(); binding++) {
+        writes.emplace_back(VK_NULL_HANDLE, binding, 0, 1,
+                            particle_expand_layout->get_type_for_binding(binding), nullptr,
+                            &buffer_infos[binding], nullptr, nullptr);
+    }
+
+    const ParticleExpandPushConstant push_constant{
+        (uint32_t)particle_records.size(),
+        particle_vertex_offset,
+        particle_primitive_offset,
+    };
+
+    cmd->bind(particle_expand_pipe);
+    cmd->push_descriptor_set(particle_expand_pipe, 0, writes);
+    cmd->push_constant(particle_expand_pipe, push_constant);
+    cmd->dispatch((particle_records.size() + PARTICLE_EXPAND_LOCAL_SIZE - 1) /
+                      PARTICLE_EXPAND_LOCAL_SIZE,
+                  1, 1);
+
+    record_expansion_post_barriers(cmd, geo);
 }
 
 void QuakeNode::update_as(const merian::CommandBufferHandle& cmd, const merian_nodes::NodeIO& io) {
@@ -992,19 +2193,23 @@ void QuakeNode::update_as(const merian::CommandBufferHandle& cmd, const merian_n
     std::shared_ptr<merian_nodes::DeviceASBuilder::TlasBuildInfo> tlas_info =
         std::make_shared<merian_nodes::DeviceASBuilder::TlasBuildInfo>(flags);
 
-    assert(static_geo.size() + dynamic_geo.size() < MAX_GEOMETRIES);
+    assert(static_geo.size() + static_entity_geo.size() + dynamic_geo.size() +
+               submodel_instance_geo.size() <=
+           MAX_GEOMETRIES);
 
     uint32_t instance_index = 0;
-    for (const auto& geo_vec : {static_geo, dynamic_geo}) {
+    for (const auto& geo_vec :
+         {static_geo, static_entity_geo, dynamic_geo, submodel_instance_geo}) {
         for (const RTGeometry& geo : geo_vec) {
-            // clang-format off
-            tlas_info->add_instance(geo.blas_info, geo.instance_flags, instance_index);
-            io[con_vtx].set(instance_index, geo.vtx, cmd, vk::AccessFlagBits2::eTransferWrite, vk::PipelineStageFlagBits2::eTransfer);
-            io[con_prev_vtx].set(instance_index, geo.prev_vtx, cmd, vk::AccessFlagBits2::eTransferWrite, vk::PipelineStageFlagBits2::eTransfer);
-            io[con_idx].set(instance_index, geo.idx, cmd, vk::AccessFlagBits2::eTransferWrite, vk::PipelineStageFlagBits2::eTransfer);
-            io[con_ext].set(instance_index, geo.ext, cmd, vk::AccessFlagBits2::eTransferWrite, vk::PipelineStageFlagBits2::eTransfer);
+            const uint32_t custom_index =
+                instance_index | (geo.motion_delta ? INSTANCE_FLAG_MOTION_DELTA : 0);
+            tlas_info->add_instance(geo.blas_info, geo.instance_flags, custom_index, geo.transform);
+            io[con_vtx].set(instance_index, geo.vtx, cmd, geo.write_access, geo.write_stage);
+            io[con_prev_vtx].set(instance_index, geo.prev_vtx, cmd, geo.write_access,
+                                 geo.write_stage);
+            io[con_idx].set(instance_index, geo.idx, cmd, geo.write_access, geo.write_stage);
+            io[con_ext].set(instance_index, geo.ext, cmd, geo.write_access, geo.write_stage);
             instance_index++;
-            // clang-format on
         }
     }
 
@@ -1018,6 +2223,19 @@ QuakeNode::NodeStatusFlags QuakeNode::properties(merian::Properties& config) {
 
     config.st_separate("General");
     config.config_bool("gamestate update", update_gamestate);
+    config.config_bool("pipeline game frame", pipeline_game_frame,
+                       "Run Host_Frame of the next frame while the current frame is recorded and "
+                       "rendered instead of in lockstep.");
+    config.config_bool("async simulation", async_simulation,
+                       "Tick the game independently of the render rate. Rendering uses the latest "
+                       "completed tick.");
+    config.config_bool("late latch camera", late_latch_camera,
+                       "Apply the mouse movement since the last tick to the camera right before "
+                       "the render info is published.");
+    if (async_simulation) {
+        config.config_float("tick rate", simulation_tick_rate,
+                            "maximum simulation ticks per second");
+    }
     update_gamestate |= frame == 0;
 
     std::string cmd;
@@ -1042,6 +2260,26 @@ QuakeNode::NodeStatusFlags QuakeNode::properties(merian::Properties& config) {
                           merian::Properties::OptionsStyle::COMBO,
                           "requires a level reload to show any effect.");
 
+    config.st_separate("Input latency");
+    config.output_text(fmt::format("events: {} dropped: {} mean: {:.1f} us max: {} us",
+                                   input_latency.total_count(), dropped_input_events,
+                                   input_latency.mean_us(), input_latency.get_max_us()));
+    {
+        std::string histogram;
+        for (uint32_t i = 0; i < LatencyHistogram::BUCKETS; i++) {
+            const uint64_t count = input_latency.count(i);
+            if (count == 0)
+                continue;
+            if (i + 1 < LatencyHistogram::BUCKETS)
+                histogram += fmt::format("< {:>7} us: {}\n", 1ull << i, count);
+            else
+                histogram += fmt::format(">= {:>6} us: {}\n", 1ull << (i - 1), count);
+        }
+        config.output_text(histogram);
+    }
+    if (config.config_bool("reset latency histogram", "resets the input latency histogram"))
+        input_latency.reset();
+
     config.st_separate("Reproducibility");
     config.config_int("stop after worldspawn", stop_after_worldspawn,
                       "Can be used for reference renders.");
@@ -1049,6 +2287,83 @@ QuakeNode::NodeStatusFlags QuakeNode::properties(merian::Properties& config) {
     config.config_bool("reproducible renders", reproducible_renders,
                        "e.g. disables random behavior");
 
+    config.st_separate("Geometry");
+    config.config_bool("shrink arenas", shrink_arenas,
+                       "Free the extraction arenas after the static geometry of a new map was "
+                       "built, they regrow to the size the frames need.");
+    config.output_text(fmt::format("arenas: {:.1f} MiB, peak: {:.1f} MiB",
+                                   arena_bytes / (1024. * 1024.),
+                                   arena_peak_bytes / (1024. * 1024.)));
+    config.output_text(fmt::format("upload ring: {:.1f} / {:.1f} MiB",
+                                   upload_ring.get_used() / (1024. * 1024.),
+                                   upload_ring.get_capacity() / (1024. * 1024.)));
+    config.config_bool("GPU alias expansion", gpu_alias_expansion,
+                       "Upload the alias model poses once per map and interpolate them in a "
+                       "compute shader instead of on the CPU.");
+    config.config_bool("weld static geometry", weld_static_geometry,
+                       "Share the vertices of the world polygons along their edges. Applies on "
+                       "the next map load.");
+    config.output_text(fmt::format("welded vertices: {}", welded_vertices));
+    config.config_bool("brush submodel instancing", submodel_instancing,
+                       "Add doors, lifts and other brush entities as TLAS instance of a per-map "
+                       "BLAS instead of rebuilding them into the dynamic geometry.");
+    if (submodel_instancing) {
+        config.output_text(fmt::format("submodel instances: {} / {}, in dynamic geometry: {}",
+                                       submodel_instance_count, get_max_submodel_instances(),
+                                       submodel_overflow_count));
+    }
+    if (config.config_bool("bake static entities", bake_static_entities,
+                           "Extract static entities that do not animate once into their own BLAS "
+                           "instead of every frame."))
+        baked_num_statics = -1;
+    config.config_bool("cache entity geometry", cache_entity_geometry,
+                       "Reuse the geometry of dynamic entities whose origin, angles, frame, lerp "
+                       "state and skin did not change.");
+    config.output_text(fmt::format("cached entities: {}", entity_cache_hits.load()));
+    run_alias_verification |= config.config_bool(
+        "verify alias expansion", "compares the CPU reference of the expansion shader with the "
+                                  "CPU path");
+    if (!alias_verify_result.empty())
+        config.output_text(alias_verify_result);
+    config.config_uint("particle budget", particle_budget,
+                       "Particles above the budget are thinned stochastically and the remaining "
+                       "are enlarged to keep the density. 0 means no limit.");
+    config.output_text(
+        fmt::format("particles kept: {} dropped: {}", particles_kept, particles_dropped));
+    bool motion_format_changed = false;
+    motion_format_changed |= config.config_bool(
+        "mapped dynamic upload", mapped_dynamic_upload,
+        "Merge the dynamic geometry directly into host visible buffers (one set per "
+        "frame in flight) instead of uploading it using the staging buffer.");
+    motion_format_changed |=
+        config.config_bool("compact motion", compact_motion,
+                           "Store the motion of the dynamic vertices as half precision deltas "
+                           "instead of the previous positions. Needs mapped dynamic upload.");
+    if (motion_format_changed) {
+        // the format is a specialization constant of the expansion shaders
+        alias_expand_pipe.reset();
+        particle_expand_pipe.reset();
+    }
+    config.config_bool("GPU particle expansion", gpu_particle_expansion,
+                       "Upload a compact record per particle and expand the tetrahedra in a "
+                       "compute shader instead of on the CPU.");
+    run_particle_verification |= config.config_bool(
+        "verify particle expansion", "compares the CPU reference of the expansion shader with the "
+                                     "CPU path");
+    if (!particle_verify_result.empty())
+        config.output_text(particle_verify_result);
+    if (config.config_bool("verify vertex transform", "compares the vectorized extraction "
+                                                      "kernels with the scalar path")) {
+        vertex_transform_verify_result =
+            fmt::format("vertex transform: {} mismatches", verify_vertex_transform_kernels());
+    }
+    if (!vertex_transform_verify_result.empty())
+        config.output_text(vertex_transform_verify_result);
+    run_extraction_benchmark |= config.config_bool(
+        "benchmark extraction", "measures the dynamic geometry extraction for 1 to N threads");
+    if (!extraction_benchmark_result.empty())
+        config.output_text(extraction_benchmark_result);
+
     config.st_separate("Debug / Info");
     config.config_bool("overwrite sun", overwrite_sun);
     if (overwrite_sun) {
@@ -1073,9 +2388,9 @@ QuakeNode::NodeStatusFlags QuakeNode::properties(merian::Properties& config) {
                     render_info.constant.sun_direction.x, render_info.constant.sun_direction.y,
                     render_info.constant.sun_direction.z, render_info.constant.sun_color.r,
                     render_info.constant.sun_color.g, render_info.constant.sun_color.b));
-    config.output_text(fmt::format("view angles {} {} {}", r_refdef.viewangles[0],
-                                   r_refdef.viewangles[1], r_refdef.viewangles[2]));
-    config.output_text(fmt::format("server fps: {}", server_fps));
+    config.output_text(fmt::format("view angles {} {} {}", view_angles.x, view_angles.y,
+                                   view_angles.z));
+    config.output_text(fmt::format("server fps: {}", server_fps.load()));
     config.config_options("player model", playermodel, {"none", "gun only", "full"});
 
     if (old_overwrite_sun != overwrite_sun || old_overwrite_sun_dir != overwrite_sun_dir ||
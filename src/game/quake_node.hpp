@@ -1,6 +1,11 @@
 #pragma once
 
+#include "game/alias_expansion.hpp"
+#include "game/input_channel.hpp"
+#include "game/particle_expansion.hpp"
 #include "game/quake_helpers.hpp"
+#include "game/range_allocator.hpp"
+#include "game/ring_allocator.hpp"
 #include "glm/ext/vector_float4.hpp"
 
 #include "merian-nodes/connectors/buffer/vk_buffer_out_unmanaged.hpp"
@@ -11,12 +16,17 @@
 #include "merian-nodes/nodes/as_builder/device_as_builder.hpp"
 
 #include "../../res/shader/config.h"
+#include "merian/utils/concurrent/thread_pool.hpp"
 #include "merian/utils/input_controller.hpp"
 #include "merian/utils/input_controller_dummy.hpp"
+#include "merian/utils/stopwatch.hpp"
 #include "merian/utils/string.hpp"
+#include "merian/vk/descriptors/descriptor_set_layout.hpp"
+#include "merian/vk/pipeline/pipeline.hpp"
 
-#include <queue>
+#include <atomic>
 #include <set>
+#include <unordered_map>
 
 extern "C" {
 #include "quakedef.h"
@@ -116,6 +126,106 @@ class QuakeNode : public merian_nodes::Node {
         std::shared_ptr<merian_nodes::DeviceASBuilder::BlasBuildInfo> blas_info;
         merian_nodes::DeviceASBuilder::BlasBuildInfo::GeometryHandle geo_handle;
         vk::GeometryInstanceFlagsKHR instance_flags;
+        // object to world transform of the TLAS instance
+        vk::TransformMatrixKHR transform{std::array<std::array<float, 4>, 3>{
+            {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}}}};
+
+        // prev_vtx holds motion deltas, see INSTANCE_FLAG_MOTION_DELTA
+        bool motion_delta = false;
+
+        // last write to the buffers
+        vk::AccessFlags2 write_access = vk::AccessFlagBits2::eTransferWrite;
+        vk::PipelineStageFlags2 write_stage = vk::PipelineStageFlagBits2::eTransfer;
+    };
+
+    // A brush submodel (door, lift, ...) in model space.
+    struct SubmodelGeometry {
+        RTGeometry geo;
+        // model space positions to compute the previous positions of moving instances
+        std::vector<float> vtx;
+    };
+
+    // Output of one worker of the dynamic geometry extraction. Kept across frames to keep the
+    // capacity.
+    struct ThreadGeometry {
+        std::vector<float> vtx;
+        std::vector<float> prev_vtx;
+        std::vector<uint32_t> idx;
+        std::vector<VertexExtraData> ext;
+        std::vector<AliasInstance> alias_instances;
+
+        void clear() {
+            vtx.clear();
+            prev_vtx.clear();
+            idx.clear();
+            ext.clear();
+            alias_instances.clear();
+        }
+
+        // clears and frees the memory
+        void release() {
+            clear();
+            vtx.shrink_to_fit();
+            prev_vtx.shrink_to_fit();
+            idx.shrink_to_fit();
+            ext.shrink_to_fit();
+            alias_instances.shrink_to_fit();
+        }
+
+        std::size_t capacity_bytes() const {
+            return vtx.capacity() * sizeof(float) + prev_vtx.capacity() * sizeof(float) +
+                   idx.capacity() * sizeof(uint32_t) + ext.capacity() * sizeof(VertexExtraData) +
+                   alias_instances.capacity() * sizeof(AliasInstance);
+        }
+    };
+
+    struct SubmodelInstance {
+        const SubmodelGeometry* submodel;
+        glm::mat4 mat_model;
+        glm::mat4 mat_prev_model;
+        // previous positions in the current model space, empty if the instance did not move
+        std::vector<float> prev_vtx;
+        // per frame in flight, a buffer might still be read by its frame
+        std::vector<merian::BufferHandle> prev_vtx_buffers;
+    };
+
+    // Geometry of a dynamic entity from the last frame it was generated, reused as long as the key
+    // does not change. Vertex indices are relative to the entity.
+    struct EntityGeometryCache {
+        EntityGeometryKey key;
+        bool valid = false;
+        std::vector<float> vtx;
+        std::vector<uint32_t> idx;
+        std::vector<VertexExtraData> ext;
+        // last update_dynamic_geo the entity was visible in
+        uint64_t last_used = 0;
+    };
+
+    // Where update_dynamic_geo wrote the geometry of an entity in thread_geo.
+    struct EntitySlice {
+        uint32_t thread;
+        uint32_t vertex_begin;
+        uint32_t vertex_count;
+        uint32_t index_begin;
+        uint32_t index_count;
+    };
+
+    // Range of an entity in the dynamic geometry. Kept across frames as long as the size of the
+    // entity does not change.
+    struct EntityRange {
+        uint32_t vertex_offset = 0;
+        uint32_t vertex_count = 0;
+        uint32_t primitive_offset = 0;
+        uint32_t primitive_count = 0;
+        uint64_t last_used = 0;
+    };
+
+    // Host visible buffers the dynamic geometry is merged into directly, without staging copy.
+    struct MappedGeometryBuffers {
+        merian::BufferHandle vtx;
+        merian::BufferHandle prev_vtx;
+        merian::BufferHandle idx;
+        merian::BufferHandle ext;
     };
 
   public:
@@ -160,21 +270,79 @@ class QuakeNode : public merian_nodes::Node {
 
     // -----------------------------------------------------
 
+    // Must be called from the thread that runs the input callbacks.
     void queue_command(std::string command) {
-        pending_commands.push(command);
+        InputEvent event;
+        event.type = InputEvent::COMMAND;
+        event.command = std::move(command);
+        push_input_event(std::move(event));
     }
 
   private:
+    // Timestamps the event and queues it for the game thread.
+    void push_input_event(InputEvent&& event);
+    // Called by the game thread before Host_Frame. Applies the queued input events up to and
+    // including the first command, such that commands are executed one per frame.
+    void drain_input_events();
+
+    // Applies the mouse movement that arrived since the last tick to angles (like IN_Move). Must be
+    // called while the game thread waits.
+    void late_latch_view_angles(vec3_t angles) const;
+
+    // Called by the game thread after Host_Frame. Hands the game state to the render thread and
+    // waits until it was extracted. With async simulation only if the render thread requested it.
+    void end_game_frame();
+    // Sleeps until the next simulation tick and returns the time since the last tick.
+    float wait_for_tick();
+
     // processes the pending uploads and updates the current descriptor set
     void update_textures(const merian::CommandBufferHandle& cmd, const merian_nodes::NodeIO& io);
 
-    void update_static_geo(const merian::CommandBufferHandle& cmd);
+    void update_static_geo(const merian::CommandBufferHandle& cmd,
+                           merian::ThreadPool& thread_pool);
+    // extracts the static entities that do not animate into their own geometry.
+    void update_static_entity_geo(const merian::CommandBufferHandle& cmd);
     void update_dynamic_geo(merian_nodes::GraphRun& run,
                             const merian::CommandBufferHandle& cmd,
                             const merian::ProfilerHandle& profiler);
+    // the entities update_dynamic_geo extracts, in extraction order.
+    void collect_dynamic_entities(std::vector<entity_t*>& entities) const;
+    // number of TLAS slots left for brush submodel instances
+    uint32_t get_max_submodel_instances() const;
+    // collects the entities for update_dynamic_geo and resolves their alias models.
+    // Must be called before entities are extracted in parallel.
+    void resolve_dynamic_entities();
+    // assigns every entity with CPU geometry its range in the dynamic geometry, see entity_ranges.
+    void assign_entity_ranges();
+    // Copies size bytes into the upload ring and returns the range, see upload_ring.
+    vk::DescriptorBufferInfo upload_to_ring(const void* data, const vk::DeviceSize size);
+    // welds vtx and idx if weld_static_geometry is set
+    void weld_static_vertices();
+    // updates arena_bytes and arena_peak_bytes
+    void update_arena_stats();
+    // frees the memory of the extraction arenas
+    void release_arenas();
+    // measures the CPU extraction of the dynamic entities for 1 to N threads and returns a report.
+    // Runs on copies of the entities that update_dynamic_geo adds on the CPU, the rendered state,
+    // the entity caches, ranges and submodel slots are not changed.
+    std::string benchmark_extraction(merian::ThreadPool& thread_pool);
+    // compares the GPU alias expansion reference with add_geo_alias for the visible entities and
+    // returns a report. Runs on copies of the entities, the rendered state is not changed.
+    std::string verify_alias_entities();
+    // expands the alias instances into the dynamic geometry, after it was uploaded.
+    void expand_alias_instances(merian_nodes::GraphRun& run,
+                                const merian::CommandBufferHandle& cmd,
+                                const RTGeometry& geo);
+    // expands the particle records into the dynamic geometry, after it was uploaded.
+    void expand_particle_records(merian_nodes::GraphRun& run,
+                                 const merian::CommandBufferHandle& cmd,
+                                 const RTGeometry& geo);
     void update_as(const merian::CommandBufferHandle& cmd, const merian_nodes::NodeIO& io);
 
   private:
+    static constexpr uint32_t ALIAS_EXPAND_LOCAL_SIZE = 64;
+    static constexpr uint32_t PARTICLE_EXPAND_LOCAL_SIZE = 64;
+
     const merian::ContextHandle context;
     const merian::ResourceAllocatorHandle allocator;
 
@@ -197,14 +365,32 @@ class QuakeNode : public merian_nodes::Node {
     std::atomic_bool game_running = true;
     merian::ConcurrentQueue<bool> sync_gamestate;
     merian::ConcurrentQueue<float> sync_render;
+    // Releases the game thread at the end of process instead of at the start, such that Host_Frame
+    // of the next frame runs while the graph records and submits the current frame. The extraction
+    // still reads the game state while the game thread waits in R_RenderScene. Outside of process
+    // (e.g. in properties) the game state must not be accessed.
+    bool pipeline_game_frame = false;
+    // the game thread was released and sync_gamestate was not popped yet
+    bool game_frame_in_flight = false;
+    // The game thread ticks with its own rate and only waits for the render thread when it
+    // requests the game state. Rendering uses the latest completed tick.
+    bool async_simulation = false;
+    float simulation_tick_rate = 72;
+    std::atomic_bool render_requested = false;
+    // Set by QS_worldspawn on the game thread, handled in process while the game thread is halted.
+    std::atomic_bool worldspawn_pending = false;
+    merian::Stopwatch tick_stopwatch;
 
     // Game state
     double old_time = 0;
     bool update_gamestate = true;
     QuakeRenderInfo render_info;
-    double server_fps = 0;
+    // written by the game thread
+    std::atomic<double> server_fps = 0;
     uint64_t frame = 0;
     uint64_t last_worldspawn_frame = 0;
+    // r_refdef.viewangles of the last processed frame, for properties
+    glm::vec3 view_angles{};
 
     // Input processing
     std::shared_ptr<merian::InputController> controller =
@@ -214,10 +400,20 @@ class QuakeNode : public merian_nodes::Node {
     double mouse_x = 0;
     double mouse_y = 0;
     bool raw_mouse_was_enabled = false;
+    // The camera orientation includes the mouse movement since the last tick. The next tick applies
+    // the same movement to cl.viewangles.
+    bool late_latch_camera = false;
+    // latest cursor position, written by the input callbacks
+    double latest_mouse_x = 0;
+    double latest_mouse_y = 0;
+
+    // Input events and commands for the game thread, see input_channel.hpp
+    SPSCRing<InputEvent, 1024> input_events;
+    uint32_t dropped_input_events = 0;
+    LatencyHistogram input_latency;
 
     // Quake commands
     std::string startup_commands = {0};
-    std::queue<std::string> pending_commands;
 
     // Helpers for image generation
     int stop_after_worldspawn = -1;
@@ -228,13 +424,126 @@ class QuakeNode : public merian_nodes::Node {
 
     // Geometry
     std::vector<RTGeometry> static_geo;
+    std::vector<RTGeometry> static_entity_geo;
     std::vector<RTGeometry> dynamic_geo;
 
-    // keep on hand to prevent realloc and copy...
+    // The vertices of the static world are merged with WELD_QUANTIZATION, the primitives that share
+    // an edge in the BSP share the vertices.
+    bool weld_static_geometry = false;
+    uint32_t welded_vertices = 0;
+
+    // static entities are baked when cl.num_statics differs, the animated ones stay dynamic.
+    bool bake_static_entities = false;
+    int baked_num_statics = -1;
+    std::vector<entity_t*> animated_statics;
+
+    // Arenas for the extraction, kept on hand to prevent realloc and copy. They grow with the
+    // geometry of the current map (geometrically, as std::vector) and are released after the static
+    // geometry of a new map was built if shrink_arenas is set.
     std::vector<float> vtx;
     std::vector<float> prev_vtx;
     std::vector<uint32_t> idx;
     std::vector<VertexExtraData> ext;
+    bool shrink_arenas = false;
+    std::size_t arena_bytes = 0;
+    std::size_t arena_peak_bytes = 0;
+
+    // one per worker of update_dynamic_geo
+    std::vector<ThreadGeometry> thread_geo;
+
+    // The dynamic geometry is written to persistently mapped buffers, one set per frame in flight
+    // (indexed by the in-flight index), instead of being uploaded using the staging buffer.
+    bool mapped_dynamic_upload = false;
+    std::vector<MappedGeometryBuffers> mapped_dynamic_buffers;
+    // The mapped prev_vtx holds the motion as half deltas, see INSTANCE_FLAG_MOTION_DELTA.
+    bool compact_motion = false;
+
+    // Host visible buffer for the per-frame inputs of the expansion shaders (alias instances,
+    // particle records), suballocated as ring over the frames in flight. Grows only if the data of
+    // the frames in flight does not fit, the previous buffers are kept until their frames finished.
+    // The dynamic geometry is not part of the ring: the graph and the BLAS builds take its buffers
+    // as a whole, see mapped_dynamic_buffers.
+    RingAllocator upload_ring;
+    merian::BufferHandle upload_ring_buffer;
+    std::vector<std::pair<uint64_t, merian::BufferHandle>> retired_upload_ring_buffers;
+    uint64_t upload_ring_frame = 0;
+
+    // entities for update_dynamic_geo and their resolved alias models (hdr == nullptr for other
+    // models), see resolve_dynamic_entities.
+    std::vector<entity_t*> dynamic_entities;
+    std::vector<ResolvedAliasModel> dynamic_alias_models;
+    // index into submodel_instances or -1 if the entity is added to the dynamic geometry
+    std::vector<int32_t> dynamic_submodel_slots;
+    // estimated extraction cost per entity, see estimate_entity_cost
+    std::vector<uint32_t> dynamic_entity_costs;
+    // entities (and the particles as last item) in the order the workers pick them up
+    std::vector<uint32_t> dynamic_work_order;
+    // Unchanged entities reuse their geometry from the previous frames. The entries are created in
+    // resolve_dynamic_entities, such that the workers only access their own entries.
+    bool cache_entity_geometry = false;
+    std::unordered_map<const entity_t*, EntityGeometryCache> entity_geometry_cache;
+    // per dynamic entity, nullptr if caching is disabled
+    std::vector<EntityGeometryCache*> dynamic_entity_caches;
+    uint64_t entity_cache_frame = 0;
+    std::atomic_uint32_t entity_cache_hits = 0;
+
+    // Entities keep their range in the dynamic geometry across frames, such that primitive ids do
+    // not depend on the scheduling of the workers. The ranges are followed by the CPU particles.
+    std::vector<EntitySlice> entity_slices;
+    std::unordered_map<const entity_t*, EntityRange> entity_ranges;
+    // per dynamic entity, nullptr if the entity has no CPU geometry
+    std::vector<const EntityRange*> dynamic_entity_ranges;
+    // ranges of entities that are listed twice, freed in the next frame
+    std::vector<EntityRange> transient_entity_ranges;
+    RangeAllocator entity_vertex_ranges;
+    RangeAllocator entity_primitive_ranges;
+    uint64_t entity_range_frame = 0;
+    // the CPU particles, see add_particles
+    ThreadGeometry particle_geo;
+    bool run_extraction_benchmark = false;
+    std::string extraction_benchmark_result;
+
+    // Brush submodels get their own BLAS on worldspawn, entities using them are added as TLAS
+    // instance as long as geometry slots are available.
+    bool submodel_instancing = false;
+    std::unordered_map<const qmodel_t*, SubmodelGeometry> submodel_geo;
+    // kept across frames to reuse the previous vertex buffers
+    std::vector<SubmodelInstance> submodel_instances;
+    uint32_t submodel_instance_count = 0;
+    // submodel entities that found no free slot and went into the dynamic geometry
+    uint32_t submodel_overflow_count = 0;
+    std::vector<RTGeometry> submodel_instance_geo;
+
+    // GPU alias expansion, see alias_expansion.hpp
+    bool gpu_alias_expansion = false;
+    AliasPoseData alias_pose_data;
+    // false if the pose data must be rebuilt and uploaded
+    bool alias_pose_data_valid = false;
+    merian::BufferHandle alias_pose_buffer;
+    std::vector<AliasInstance> alias_instances;
+    merian::DescriptorSetLayoutHandle alias_expand_layout;
+    merian::PipelineHandle alias_expand_pipe;
+    // Verification requested in properties, run in process while the game thread is halted.
+    bool run_alias_verification = false;
+    bool run_particle_verification = false;
+    std::string alias_verify_result;
+    std::string particle_verify_result;
+
+    // Particles above the budget are thinned stochastically, 0 means no limit.
+    uint32_t particle_budget = 0;
+    uint32_t particles_kept = 0;
+    uint32_t particles_dropped = 0;
+
+    // GPU particle expansion, see particle_expansion.hpp
+    bool gpu_particle_expansion = false;
+    std::vector<ParticleRecord> particle_records;
+    // where the expanded particles are written in the dynamic geometry
+    uint32_t particle_vertex_offset = 0;
+    uint32_t particle_primitive_offset = 0;
+    merian::DescriptorSetLayoutHandle particle_expand_layout;
+    merian::PipelineHandle particle_expand_pipe;
+
+    std::string vertex_transform_verify_result;
 
     // Store some textures for custom patches
     uint32_t texnum_blood = 0;
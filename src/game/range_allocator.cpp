@@ -0,0 +1,61 @@
+#include "range_allocator.hpp"
+
+#include <cassert>
+#include <iterator>
+
+uint32_t RangeAllocator::allocate(const uint32_t count) {
+    assert(count > 0);
+    allocated_count += count;
+
+    for (auto it = free_ranges.begin(); it != free_ranges.end(); it++) {
+        if (it->second < count)
+            continue;
+        const uint32_t offset = it->first;
+        const uint32_t remaining = it->second - count;
+        free_ranges.erase(it);
+        if (remaining > 0)
+            free_ranges.emplace(offset + count, remaining);
+        return offset;
+    }
+
+    const uint32_t offset = end;
+    end += count;
+    return offset;
+}
+
+void RangeAllocator::free(const uint32_t offset, const uint32_t count) {
+    assert(count > 0 && offset + count <= end);
+    assert(allocated_count >= count);
+    allocated_count -= count;
+
+    uint32_t begin = offset;
+    uint32_t merged_count = count;
+    // coalesce with the following range
+    auto next = free_ranges.find(offset + count);
+    if (next != free_ranges.end()) {
+        merged_count += next->second;
+        free_ranges.erase(next);
+    }
+    // and with the preceding range
+    auto it = free_ranges.lower_bound(offset);
+    if (it != free_ranges.begin()) {
+        auto prev = std::prev(it);
+        if (prev->first + prev->second == offset) {
+            begin = prev->first;
+            merged_count += prev->second;
+            free_ranges.erase(prev);
+        }
+    }
+
+    if (begin + merged_count == end) {
+        end = begin;
+    } else {
+        free_ranges.emplace(begin, merged_count);
+    }
+}
+
+void RangeAllocator::reset() {
+    free_ranges.clear();
+    end = 0;
+    allocated_count = 0;
+}
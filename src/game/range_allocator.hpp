@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+
+// First fit allocator for ranges of elements in a linear buffer.
+//
+// Used to give dynamic entities ranges in the dynamic geometry that stay the same across frames.
+// Allocations never fail, the buffer grows at the end if no free range is large enough. Freed
+// ranges are coalesced with their neighbors and the end shrinks if the last range is freed.
+class RangeAllocator {
+  public:
+    // Returns the offset of a new range of count elements. count must be > 0.
+    uint32_t allocate(const uint32_t count);
+
+    // Frees a range that was returned by allocate.
+    void free(const uint32_t offset, const uint32_t count);
+
+    // Frees all ranges.
+    void reset();
+
+    // The size the buffer must have to hold all ranges.
+    uint32_t size() const {
+        return end;
+    }
+
+    // Number of elements in allocated ranges.
+    uint32_t allocated() const {
+        return allocated_count;
+    }
+
+    // Free ranges below size() (offset -> count).
+    const std::map<uint32_t, uint32_t>& get_free_ranges() const {
+        return free_ranges;
+    }
+
+  private:
+    std::map<uint32_t, uint32_t> free_ranges;
+    uint32_t end = 0;
+    uint32_t allocated_count = 0;
+};
@@ -0,0 +1,42 @@
+#include "ring_allocator.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+static uint64_t align_up(const uint64_t value, const uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+void RingAllocator::begin_frame(const uint32_t in_flight_index) {
+    if (slot_end.size() <= in_flight_index)
+        slot_end.resize(in_flight_index + 1, tail);
+
+    tail = std::max(tail, slot_end[in_flight_index]);
+    slot_end[in_flight_index] = head;
+    current_slot = in_flight_index;
+}
+
+std::optional<uint64_t> RingAllocator::allocate(const uint64_t size, const uint64_t alignment) {
+    assert(alignment > 0);
+    if (size == 0 || size > capacity || capacity % alignment != 0)
+        return std::nullopt;
+
+    uint64_t begin = align_up(head, alignment);
+    if (begin / capacity != (begin + size - 1) / capacity) {
+        // does not fit before the end, wrap to the front
+        begin = align_up(begin, capacity);
+    }
+    if (begin + size - tail > capacity)
+        return std::nullopt;
+
+    head = begin + size;
+    if (current_slot < slot_end.size())
+        slot_end[current_slot] = head;
+    return begin % capacity;
+}
+
+void RingAllocator::reset(const uint64_t new_capacity) {
+    capacity = new_capacity;
+    head = tail = 0;
+    std::fill(slot_end.begin(), slot_end.end(), 0);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Ring suballocator for per-frame data, the allocation logic only.
+//
+// Every frame allocates aligned ranges of a buffer with fixed capacity. The ranges of a frame are
+// freed when its in-flight slot is used again, since then the GPU finished the frame and all frames
+// before it. Allocations that do not fit before the end of the buffer wrap to the front. There is
+// no reallocation as long as the data of all frames in flight fits.
+class RingAllocator {
+  public:
+    explicit RingAllocator(const uint64_t capacity = 0) : capacity(capacity) {}
+
+    // Must be called at the start of every frame with its in-flight index. Frees the ranges that
+    // were allocated the last time this in-flight index was used.
+    void begin_frame(const uint32_t in_flight_index);
+
+    // Returns the offset of a range of size bytes, std::nullopt if the ring is full. alignment must
+    // divide the capacity.
+    std::optional<uint64_t> allocate(const uint64_t size, const uint64_t alignment);
+
+    // Frees all ranges and sets a new capacity.
+    void reset(const uint64_t new_capacity);
+
+    uint64_t get_capacity() const {
+        return capacity;
+    }
+
+    // Bytes used by the frames in flight, including padding.
+    uint64_t get_used() const {
+        return head - tail;
+    }
+
+    // Number of in-flight indices seen so far.
+    uint32_t get_frames_in_flight() const {
+        return slot_end.size();
+    }
+
+  private:
+    uint64_t capacity;
+    // monotonic positions, the physical offset is position % capacity
+    uint64_t head = 0;
+    uint64_t tail = 0;
+    // head after the last allocation of each in-flight slot
+    std::vector<uint64_t> slot_end;
+    uint32_t current_slot = 0;
+};
@@ -0,0 +1,415 @@
+#include "vertex_transform.hpp"
+
+#include "merian/utils/bitpacking.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+// Scalar --------------------------------------------------------------------------------------
+
+static inline void transform_one(const float x,
+                                 const float y,
+                                 const float z,
+                                 const glm::mat4& m,
+                                 float* out) {
+    out[0] = m[0][0] * x + m[1][0] * y + m[2][0] * z + m[3][0];
+    out[1] = m[0][1] * x + m[1][1] * y + m[2][1] * z + m[3][1];
+    out[2] = m[0][2] * x + m[1][2] * y + m[2][2] * z + m[3][2];
+}
+
+void transform_positions_2_scalar(const float* positions,
+                                  const std::size_t stride,
+                                  const std::size_t count,
+                                  const glm::mat4& mat_a,
+                                  const glm::mat4& mat_b,
+                                  float* out_a,
+                                  float* out_b) {
+    for (std::size_t v = 0; v < count; v++) {
+        const float* p = positions + stride * v;
+        transform_one(p[0], p[1], p[2], mat_a, out_a + 3 * v);
+        transform_one(p[0], p[1], p[2], mat_b, out_b + 3 * v);
+    }
+}
+
+static inline void lerp_transform_range_scalar(const SoAPositions& p1,
+                                               const SoAPositions& p2,
+                                               const std::size_t begin,
+                                               const std::size_t end,
+                                               const float blend,
+                                               const glm::mat4& mat,
+                                               float* out) {
+    for (std::size_t v = begin; v < end; v++) {
+        const float x = p1.x[v] * (1.f - blend) + p2.x[v] * blend;
+        const float y = p1.y[v] * (1.f - blend) + p2.y[v] * blend;
+        const float z = p1.z[v] * (1.f - blend) + p2.z[v] * blend;
+        transform_one(x, y, z, mat, out + 3 * v);
+    }
+}
+
+void lerp_transform_positions_2_scalar(const SoAPositions& p1,
+                                       const SoAPositions& p2,
+                                       const std::size_t count,
+                                       const float blend_a,
+                                       const glm::mat4& mat_a,
+                                       const float blend_b,
+                                       const glm::mat4& mat_b,
+                                       float* out_a,
+                                       float* out_b) {
+    lerp_transform_range_scalar(p1, p2, 0, count, blend_a, mat_a, out_a);
+    lerp_transform_range_scalar(p1, p2, 0, count, blend_b, mat_b, out_b);
+}
+
+void floats_to_halfs_scalar(const float* in,
+                            const std::size_t stride,
+                            const std::size_t count,
+                            uint16_t* out) {
+    for (std::size_t i = 0; i < count; i++) {
+        out[i] = merian::float_to_half(in[stride * i]);
+    }
+}
+
+void write_motion_deltas_scalar(const float* vtx,
+                                const float* prev_vtx,
+                                const std::size_t count,
+                                const float max_delta,
+                                uint16_t* out) {
+    for (std::size_t v = 0; v < count; v++) {
+        float delta[3];
+        bool escape = false;
+        for (int l = 0; l < 3; l++) {
+            delta[l] = prev_vtx[3 * v + l] - vtx[3 * v + l];
+            escape |= !(std::abs(delta[l]) <= max_delta);
+        }
+        for (int l = 0; l < 3; l++)
+            out[4 * v + l] = escape ? 0 : merian::float_to_half(delta[l]);
+        out[4 * v + 3] = 0;
+    }
+}
+
+// Vectorized ----------------------------------------------------------------------------------
+
+#if defined(__AVX2__)
+
+// Both matrices are processed at once: mat_a in the lower and mat_b in the upper 128 bit lane.
+void transform_positions_2(const float* positions,
+                           const std::size_t stride,
+                           const std::size_t count,
+                           const glm::mat4& mat_a,
+                           const glm::mat4& mat_b,
+                           float* out_a,
+                           float* out_b) {
+    if (count == 0)
+        return;
+
+    const auto column = [&](const int c) {
+        return _mm256_setr_ps(mat_a[c][0], mat_a[c][1], mat_a[c][2], 0, mat_b[c][0], mat_b[c][1],
+                              mat_b[c][2], 0);
+    };
+    const __m256 c0 = column(0);
+    const __m256 c1 = column(1);
+    const __m256 c2 = column(2);
+    const __m256 c3 = column(3);
+
+    // the 4th component is stored as well and overwritten by the next vertex, the last vertex is
+    // transformed by the scalar path to not write past the end.
+    for (std::size_t v = 0; v + 1 < count; v++) {
+        const float* p = positions + stride * v;
+        __m256 r = _mm256_add_ps(c3, _mm256_mul_ps(c0, _mm256_set1_ps(p[0])));
+        r = _mm256_add_ps(r, _mm256_mul_ps(c1, _mm256_set1_ps(p[1])));
+        r = _mm256_add_ps(r, _mm256_mul_ps(c2, _mm256_set1_ps(p[2])));
+        _mm_storeu_ps(out_a + 3 * v, _mm256_castps256_ps128(r));
+        _mm_storeu_ps(out_b + 3 * v, _mm256_extractf128_ps(r, 1));
+    }
+    transform_positions_2_scalar(positions + stride * (count - 1), stride, 1, mat_a, mat_b,
+                                 out_a + 3 * (count - 1), out_b + 3 * (count - 1));
+}
+
+// 8 positions at once in SoA form, interleaved on store.
+static void lerp_transform_positions(const SoAPositions& p1,
+                                     const SoAPositions& p2,
+                                     const std::size_t count,
+                                     const float blend,
+                                     const glm::mat4& mat,
+                                     float* out) {
+    const __m256 b = _mm256_set1_ps(blend);
+    const __m256 ib = _mm256_set1_ps(1.f - blend);
+    __m256 m[4][3];
+    for (int c = 0; c < 4; c++)
+        for (int r = 0; r < 3; r++)
+            m[c][r] = _mm256_set1_ps(mat[c][r]);
+
+    alignas(32) float result[3][8];
+    std::size_t v = 0;
+    for (; v + 8 <= count; v += 8) {
+        const __m256 x = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(p1.x + v), ib),
+                                       _mm256_mul_ps(_mm256_loadu_ps(p2.x + v), b));
+        const __m256 y = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(p1.y + v), ib),
+                                       _mm256_mul_ps(_mm256_loadu_ps(p2.y + v), b));
+        const __m256 z = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(p1.z + v), ib),
+                                       _mm256_mul_ps(_mm256_loadu_ps(p2.z + v), b));
+        for (int r = 0; r < 3; r++) {
+            __m256 o = _mm256_add_ps(_mm256_mul_ps(m[0][r], x), _mm256_mul_ps(m[1][r], y));
+            o = _mm256_add_ps(o, _mm256_mul_ps(m[2][r], z));
+            _mm256_store_ps(result[r], _mm256_add_ps(o, m[3][r]));
+        }
+        for (int i = 0; i < 8; i++) {
+            out[3 * (v + i) + 0] = result[0][i];
+            out[3 * (v + i) + 1] = result[1][i];
+            out[3 * (v + i) + 2] = result[2][i];
+        }
+    }
+    lerp_transform_range_scalar(p1, p2, v, count, blend, mat, out);
+}
+
+#elif defined(__SSE2__)
+
+void transform_positions_2(const float* positions,
+                           const std::size_t stride,
+                           const std::size_t count,
+                           const glm::mat4& mat_a,
+                           const glm::mat4& mat_b,
+                           float* out_a,
+                           float* out_b) {
+    if (count == 0)
+        return;
+
+    __m128 a[4];
+    __m128 b[4];
+    for (int c = 0; c < 4; c++) {
+        a[c] = _mm_setr_ps(mat_a[c][0], mat_a[c][1], mat_a[c][2], 0);
+        b[c] = _mm_setr_ps(mat_b[c][0], mat_b[c][1], mat_b[c][2], 0);
+    }
+
+    // see AVX2 variant
+    for (std::size_t v = 0; v + 1 < count; v++) {
+        const float* p = positions + stride * v;
+        const __m128 x = _mm_set1_ps(p[0]);
+        const __m128 y = _mm_set1_ps(p[1]);
+        const __m128 z = _mm_set1_ps(p[2]);
+        __m128 ra = _mm_add_ps(a[3], _mm_mul_ps(a[0], x));
+        ra = _mm_add_ps(ra, _mm_mul_ps(a[1], y));
+        ra = _mm_add_ps(ra, _mm_mul_ps(a[2], z));
+        __m128 rb = _mm_add_ps(b[3], _mm_mul_ps(b[0], x));
+        rb = _mm_add_ps(rb, _mm_mul_ps(b[1], y));
+        rb = _mm_add_ps(rb, _mm_mul_ps(b[2], z));
+        _mm_storeu_ps(out_a + 3 * v, ra);
+        _mm_storeu_ps(out_b + 3 * v, rb);
+    }
+    transform_positions_2_scalar(positions + stride * (count - 1), stride, 1, mat_a, mat_b,
+                                 out_a + 3 * (count - 1), out_b + 3 * (count - 1));
+}
+
+// 4 positions at once in SoA form, interleaved on store.
+static void lerp_transform_positions(const SoAPositions& p1,
+                                     const SoAPositions& p2,
+                                     const std::size_t count,
+                                     const float blend,
+                                     const glm::mat4& mat,
+                                     float* out) {
+    const __m128 b = _mm_set1_ps(blend);
+    const __m128 ib = _mm_set1_ps(1.f - blend);
+    __m128 m[4][3];
+    for (int c = 0; c < 4; c++)
+        for (int r = 0; r < 3; r++)
+            m[c][r] = _mm_set1_ps(mat[c][r]);
+
+    alignas(16) float result[3][4];
+    std::size_t v = 0;
+    for (; v + 4 <= count; v += 4) {
+        const __m128 x = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p1.x + v), ib),
+                                    _mm_mul_ps(_mm_loadu_ps(p2.x + v), b));
+        const __m128 y = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p1.y + v), ib),
+                                    _mm_mul_ps(_mm_loadu_ps(p2.y + v), b));
+        const __m128 z = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p1.z + v), ib),
+                                    _mm_mul_ps(_mm_loadu_ps(p2.z + v), b));
+        for (int r = 0; r < 3; r++) {
+            __m128 o = _mm_add_ps(_mm_mul_ps(m[0][r], x), _mm_mul_ps(m[1][r], y));
+            o = _mm_add_ps(o, _mm_mul_ps(m[2][r], z));
+            _mm_store_ps(result[r], _mm_add_ps(o, m[3][r]));
+        }
+        for (int i = 0; i < 4; i++) {
+            out[3 * (v + i) + 0] = result[0][i];
+            out[3 * (v + i) + 1] = result[1][i];
+            out[3 * (v + i) + 2] = result[2][i];
+        }
+    }
+    lerp_transform_range_scalar(p1, p2, v, count, blend, mat, out);
+}
+
+#else
+
+void transform_positions_2(const float* positions,
+                           const std::size_t stride,
+                           const std::size_t count,
+                           const glm::mat4& mat_a,
+                           const glm::mat4& mat_b,
+                           float* out_a,
+                           float* out_b) {
+    transform_positions_2_scalar(positions, stride, count, mat_a, mat_b, out_a, out_b);
+}
+
+static void lerp_transform_positions(const SoAPositions& p1,
+                                     const SoAPositions& p2,
+                                     const std::size_t count,
+                                     const float blend,
+                                     const glm::mat4& mat,
+                                     float* out) {
+    lerp_transform_range_scalar(p1, p2, 0, count, blend, mat, out);
+}
+
+#endif
+
+void lerp_transform_positions_2(const SoAPositions& p1,
+                                const SoAPositions& p2,
+                                const std::size_t count,
+                                const float blend_a,
+                                const glm::mat4& mat_a,
+                                const float blend_b,
+                                const glm::mat4& mat_b,
+                                float* out_a,
+                                float* out_b) {
+    lerp_transform_positions(p1, p2, count, blend_a, mat_a, out_a);
+    lerp_transform_positions(p1, p2, count, blend_b, mat_b, out_b);
+}
+
+#if defined(__F16C__)
+
+void floats_to_halfs(const float* in,
+                     const std::size_t stride,
+                     const std::size_t count,
+                     uint16_t* out) {
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128 f = _mm_setr_ps(in[stride * i], in[stride * (i + 1)], in[stride * (i + 2)],
+                                     in[stride * (i + 3)]);
+        _mm_storel_epi64((__m128i*)(out + i), _mm_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; i < count; i++) {
+        out[i] = _cvtss_sh(in[stride * i], _MM_FROUND_TO_NEAREST_INT);
+    }
+}
+
+// One vertex per iteration, the 4th lane of the load is masked out.
+void write_motion_deltas(const float* vtx,
+                         const float* prev_vtx,
+                         const std::size_t count,
+                         const float max_delta,
+                         uint16_t* out) {
+    if (count == 0)
+        return;
+
+    const __m128 max = _mm_set1_ps(max_delta);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 xyz_mask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+
+    // see transform_positions_2, the last vertex is done by the scalar path to not read past the
+    // end.
+    for (std::size_t v = 0; v + 1 < count; v++) {
+        const __m128 delta = _mm_and_ps(
+            _mm_sub_ps(_mm_loadu_ps(prev_vtx + 3 * v), _mm_loadu_ps(vtx + 3 * v)), xyz_mask);
+        // NaN compares false and escapes as well
+        const bool escape =
+            _mm_movemask_ps(_mm_cmple_ps(_mm_and_ps(delta, abs_mask), max)) != 0xf;
+        const __m128i halfs =
+            escape ? _mm_setzero_si128() : _mm_cvtps_ph(delta, _MM_FROUND_TO_NEAREST_INT);
+        _mm_storel_epi64((__m128i*)(out + 4 * v), halfs);
+    }
+    write_motion_deltas_scalar(vtx + 3 * (count - 1), prev_vtx + 3 * (count - 1), 1, max_delta,
+                               out + 4 * (count - 1));
+}
+
+#else
+
+void floats_to_halfs(const float* in,
+                     const std::size_t stride,
+                     const std::size_t count,
+                     uint16_t* out) {
+    floats_to_halfs_scalar(in, stride, count, out);
+}
+
+void write_motion_deltas(const float* vtx,
+                         const float* prev_vtx,
+                         const std::size_t count,
+                         const float max_delta,
+                         uint16_t* out) {
+    write_motion_deltas_scalar(vtx, prev_vtx, count, max_delta, out);
+}
+
+#endif
+
+// Verification --------------------------------------------------------------------------------
+
+uint32_t verify_vertex_transform_kernels() {
+    static constexpr std::size_t count = 1027; // not a multiple of the vector width
+    static constexpr std::size_t stride = 7;   // like VERTEXSIZE for brush polygons
+
+    std::mt19937 rng(1337);
+    std::uniform_real_distribution<float> dist(-1000.f, 1000.f);
+
+    glm::mat4 mat_a;
+    glm::mat4 mat_b;
+    for (int c = 0; c < 4; c++)
+        for (int r = 0; r < 4; r++) {
+            mat_a[c][r] = dist(rng) / 1000.f;
+            mat_b[c][r] = dist(rng) / 1000.f;
+        }
+
+    std::vector<float> positions(stride * count);
+    std::generate(positions.begin(), positions.end(), [&]() { return dist(rng); });
+    std::vector<float> x(count), y(count), z(count);
+    for (std::size_t v = 0; v < count; v++) {
+        x[v] = positions[stride * v];
+        y[v] = positions[stride * v + 1];
+        z[v] = positions[stride * v + 2];
+    }
+
+    const auto differs = [](const float a, const float b) {
+        return std::abs(a - b) > 1e-4f * std::max(1.f, std::abs(a));
+    };
+    uint32_t mismatches = 0;
+
+    std::vector<float> ref_a(3 * count), ref_b(3 * count), out_a(3 * count), out_b(3 * count);
+    transform_positions_2_scalar(positions.data(), stride, count, mat_a, mat_b, ref_a.data(),
+                                 ref_b.data());
+    transform_positions_2(positions.data(), stride, count, mat_a, mat_b, out_a.data(),
+                          out_b.data());
+    for (std::size_t i = 0; i < 3 * count; i++)
+        mismatches += differs(ref_a[i], out_a[i]) + differs(ref_b[i], out_b[i]);
+
+    const SoAPositions p1{x.data(), y.data(), z.data()};
+    const SoAPositions p2{z.data(), x.data(), y.data()};
+    lerp_transform_positions_2_scalar(p1, p2, count, 0.25, mat_a, 0.75, mat_b, ref_a.data(),
+                                      ref_b.data());
+    lerp_transform_positions_2(p1, p2, count, 0.25, mat_a, 0.75, mat_b, out_a.data(),
+                               out_b.data());
+    for (std::size_t i = 0; i < 3 * count; i++)
+        mismatches += differs(ref_a[i], out_a[i]) + differs(ref_b[i], out_b[i]);
+
+    // texture coordinates are in [0, 1] mostly, 1 ulp is allowed for different rounding
+    std::vector<float> st(stride * count);
+    std::generate(st.begin(), st.end(), [&]() { return dist(rng) / 500.f; });
+    std::vector<uint16_t> ref_h(count), out_h(count);
+    floats_to_halfs_scalar(st.data(), stride, count, ref_h.data());
+    floats_to_halfs(st.data(), stride, count, out_h.data());
+    for (std::size_t i = 0; i < count; i++)
+        mismatches += std::abs((int)ref_h[i] - (int)out_h[i]) > 1;
+
+    // motion with some vertices beyond the maximum delta
+    std::vector<float> moved(positions.begin(), positions.begin() + 3 * count);
+    std::generate(moved.begin(), moved.end(), [&]() { return dist(rng); });
+    for (std::size_t i = 0; i < 3 * count; i++)
+        moved[i] = positions[i] + moved[i] / (i % 5 == 0 ? 1.f : 10.f);
+    std::vector<uint16_t> ref_d(4 * count), out_d(4 * count);
+    write_motion_deltas_scalar(positions.data(), moved.data(), count, 256.f, ref_d.data());
+    write_motion_deltas(positions.data(), moved.data(), count, 256.f, out_d.data());
+    for (std::size_t i = 0; i < 4 * count; i++)
+        mismatches += std::abs((int)ref_d[i] - (int)out_d[i]) > 1;
+
+    return mismatches;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Batched vertex transforms for the geometry extraction.
+//
+// Every kernel transforms a block of positions by the current and the previous model matrix at
+// once and writes tightly packed vec3 into pre-sized outputs. Depending on the target the kernels
+// use AVX2 or SSE with a scalar fallback, the *_scalar variants are always the scalar path.
+// Results of the vector paths may differ from the scalar path by rounding.
+
+// Positions in structure of arrays layout.
+struct SoAPositions {
+    const float* x;
+    const float* y;
+    const float* z;
+};
+
+// Transforms count positions (xyz, stride floats apart) by mat_a into out_a and by mat_b into
+// out_b. Only the affine part of the matrices is used.
+void transform_positions_2(const float* positions,
+                           const std::size_t stride,
+                           const std::size_t count,
+                           const glm::mat4& mat_a,
+                           const glm::mat4& mat_b,
+                           float* out_a,
+                           float* out_b);
+
+void transform_positions_2_scalar(const float* positions,
+                                  const std::size_t stride,
+                                  const std::size_t count,
+                                  const glm::mat4& mat_a,
+                                  const glm::mat4& mat_b,
+                                  float* out_a,
+                                  float* out_b);
+
+// Interpolates count positions between p1 and p2 with blend_a and blend_b (as glm::mix) and
+// transforms the results by mat_a into out_a and by mat_b into out_b.
+void lerp_transform_positions_2(const SoAPositions& p1,
+                                const SoAPositions& p2,
+                                const std::size_t count,
+                                const float blend_a,
+                                const glm::mat4& mat_a,
+                                const float blend_b,
+                                const glm::mat4& mat_b,
+                                float* out_a,
+                                float* out_b);
+
+void lerp_transform_positions_2_scalar(const SoAPositions& p1,
+                                       const SoAPositions& p2,
+                                       const std::size_t count,
+                                       const float blend_a,
+                                       const glm::mat4& mat_a,
+                                       const float blend_b,
+                                       const glm::mat4& mat_b,
+                                       float* out_a,
+                                       float* out_b);
+
+// Converts count floats (stride floats apart) to half using F16C if available (round to nearest
+// even), merian::float_to_half otherwise.
+void floats_to_halfs(const float* in,
+                     const std::size_t stride,
+                     const std::size_t count,
+                     uint16_t* out);
+
+void floats_to_halfs_scalar(const float* in,
+                            const std::size_t stride,
+                            const std::size_t count,
+                            uint16_t* out);
+
+// Writes the motion prev_vtx - vtx of count vertices (tightly packed vec3) as 4 halfs per vertex
+// to out, the 4th is 0. If a component exceeds max_delta the motion of the vertex is written as 0.
+void write_motion_deltas(const float* vtx,
+                         const float* prev_vtx,
+                         const std::size_t count,
+                         const float max_delta,
+                         uint16_t* out);
+
+void write_motion_deltas_scalar(const float* vtx,
+                                const float* prev_vtx,
+                                const std::size_t count,
+                                const float max_delta,
+                                uint16_t* out);
+
+// Runs all kernels on random input and compares against the scalar variants. Returns the number of
+// mismatching values.
+uint32_t verify_vertex_transform_kernels();
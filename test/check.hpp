@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdio>
+
+// Minimal checks for the CPU tests: CHECK reports a failed condition and counts it, the test
+// returns check_failures() from main.
+
+inline int& check_failures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition)                                                                           \
+    do {                                                                                           \
+        if (!(condition)) {                                                                        \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);    \
+            check_failures()++;                                                                    \
+        }                                                                                          \
+    } while (false)
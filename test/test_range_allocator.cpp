@@ -0,0 +1,103 @@
+#include "game/range_allocator.hpp"
+
+#include "check.hpp"
+
+#include <vector>
+
+static void test_allocate() {
+    RangeAllocator ranges;
+    CHECK(ranges.allocate(10) == 0);
+    CHECK(ranges.allocate(5) == 10);
+    CHECK(ranges.allocate(1) == 15);
+    CHECK(ranges.size() == 16);
+    CHECK(ranges.allocated() == 16);
+    CHECK(ranges.get_free_ranges().empty());
+}
+
+static void test_free() {
+    RangeAllocator ranges;
+    const uint32_t a = ranges.allocate(10);
+    const uint32_t b = ranges.allocate(5);
+    const uint32_t c = ranges.allocate(3);
+
+    ranges.free(b, 5);
+    CHECK(ranges.allocated() == 13);
+    CHECK(ranges.size() == 18);
+    CHECK(ranges.get_free_ranges().size() == 1);
+    CHECK(ranges.get_free_ranges().at(10) == 5);
+
+    // freeing the last range shrinks the end, including the free range before it
+    ranges.free(c, 3);
+    CHECK(ranges.size() == 10);
+    CHECK(ranges.get_free_ranges().empty());
+
+    ranges.free(a, 10);
+    CHECK(ranges.size() == 0);
+    CHECK(ranges.allocated() == 0);
+}
+
+static void test_coalescing() {
+    RangeAllocator ranges;
+    std::vector<uint32_t> offsets;
+    for (int i = 0; i < 5; i++)
+        offsets.emplace_back(ranges.allocate(4));
+
+    // with the following range
+    ranges.free(offsets[2], 4);
+    ranges.free(offsets[1], 4);
+    CHECK(ranges.get_free_ranges().size() == 1);
+    CHECK(ranges.get_free_ranges().at(4) == 8);
+
+    // with the preceding range
+    ranges.free(offsets[3], 4);
+    CHECK(ranges.get_free_ranges().size() == 1);
+    CHECK(ranges.get_free_ranges().at(4) == 12);
+
+    // with both
+    ranges.allocate(12);
+    ranges.free(4, 4);
+    ranges.free(12, 4);
+    CHECK(ranges.get_free_ranges().size() == 2);
+    ranges.free(8, 4);
+    CHECK(ranges.get_free_ranges().size() == 1);
+    CHECK(ranges.get_free_ranges().at(4) == 12);
+    CHECK(ranges.allocated() == 8);
+    CHECK(ranges.size() == 20);
+}
+
+static void test_fragmentation() {
+    RangeAllocator ranges;
+    std::vector<uint32_t> offsets;
+    for (int i = 0; i < 8; i++)
+        offsets.emplace_back(ranges.allocate(4));
+    // every second range is freed, no free range holds more than 4 elements
+    for (int i = 0; i < 8; i += 2)
+        ranges.free(offsets[i], 4);
+    CHECK(ranges.get_free_ranges().size() == 4);
+    CHECK(ranges.allocated() == 16);
+
+    // a larger range does not fit into the holes and is placed at the end
+    CHECK(ranges.allocate(5) == 32);
+    CHECK(ranges.size() == 37);
+
+    // first fit: smaller ranges fill the first hole and split it
+    CHECK(ranges.allocate(3) == 0);
+    CHECK(ranges.allocate(1) == 3);
+    CHECK(ranges.allocate(2) == 8);
+    CHECK(ranges.get_free_ranges().size() == 3);
+    CHECK(ranges.get_free_ranges().at(10) == 2);
+
+    ranges.reset();
+    CHECK(ranges.size() == 0);
+    CHECK(ranges.allocated() == 0);
+    CHECK(ranges.get_free_ranges().empty());
+    CHECK(ranges.allocate(7) == 0);
+}
+
+int main() {
+    test_allocate();
+    test_free();
+    test_coalescing();
+    test_fragmentation();
+    return check_failures();
+}
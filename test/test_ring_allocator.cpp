@@ -0,0 +1,81 @@
+#include "game/ring_allocator.hpp"
+
+#include "check.hpp"
+
+static void test_alignment() {
+    RingAllocator ring(256);
+    ring.begin_frame(0);
+    CHECK(ring.allocate(3, 1) == 0);
+    CHECK(ring.allocate(8, 16) == 16);
+    CHECK(ring.allocate(4, 4) == 24);
+    CHECK(ring.get_used() == 28);
+
+    // the alignment must divide the capacity
+    CHECK(!ring.allocate(4, 48).has_value());
+    CHECK(!ring.allocate(0, 4).has_value());
+    CHECK(!ring.allocate(257, 1).has_value());
+}
+
+static void test_wrap_and_full() {
+    RingAllocator ring(256);
+    ring.begin_frame(0);
+    CHECK(ring.allocate(100, 4) == 0);
+    ring.begin_frame(1);
+    CHECK(ring.allocate(100, 4) == 100);
+    CHECK(ring.get_frames_in_flight() == 2);
+
+    // frame 0 finished. 100 bytes do not fit before the end and wrap to the front.
+    ring.begin_frame(0);
+    CHECK(ring.allocate(100, 4) == 0);
+    CHECK(ring.get_used() == 256);
+
+    // frame 1 is still in flight
+    CHECK(!ring.allocate(1, 1).has_value());
+}
+
+static void test_slot_reuse() {
+    RingAllocator ring(256);
+    ring.begin_frame(0);
+    CHECK(ring.allocate(100, 4) == 0);
+    ring.begin_frame(1);
+    CHECK(ring.allocate(100, 4) == 100);
+    ring.begin_frame(0);
+    CHECK(ring.allocate(100, 4) == 0);
+
+    // reusing slot 1 frees the 100 bytes of its previous frame, the padding before the wrap stays
+    // used until the frame after it is freed
+    ring.begin_frame(1);
+    CHECK(ring.get_used() == 156);
+    CHECK(ring.allocate(100, 4) == 100);
+    CHECK(!ring.allocate(100, 4).has_value());
+
+    // a frame without allocations frees its previous range as well
+    ring.begin_frame(0);
+    CHECK(ring.get_used() == 100);
+    ring.begin_frame(1);
+    CHECK(ring.get_used() == 0);
+}
+
+static void test_reset() {
+    RingAllocator ring(256);
+    ring.begin_frame(0);
+    CHECK(ring.allocate(200, 4) == 0);
+    ring.begin_frame(1);
+    CHECK(!ring.allocate(200, 4).has_value());
+
+    ring.reset(512);
+    CHECK(ring.get_capacity() == 512);
+    CHECK(ring.get_used() == 0);
+    CHECK(ring.get_frames_in_flight() == 2);
+    CHECK(ring.allocate(300, 4) == 0);
+    ring.begin_frame(0);
+    CHECK(ring.allocate(200, 4) == 300);
+}
+
+int main() {
+    test_alignment();
+    test_wrap_and_full();
+    test_slot_reuse();
+    test_reset();
+    return check_failures();
+}
@@ -0,0 +1,13 @@
+#include "game/vertex_transform.hpp"
+
+#include <cstdio>
+
+// Compares the vectorized extraction kernels of this build with their scalar variants.
+int main() {
+    const uint32_t mismatches = verify_vertex_transform_kernels();
+    if (mismatches > 0) {
+        std::fprintf(stderr, "vertex transform: %u mismatches\n", mismatches);
+        return 1;
+    }
+    return 0;
+}